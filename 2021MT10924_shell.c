@@ -1,413 +1,7132 @@
+#define _GNU_SOURCE // copy_file_range and splice
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <poll.h>
+#include <pwd.h>
+#include <regex.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
 
-#define INITIAL_ARGS_SIZE 10
 #define INITIAL_CMD_SIZE 1024
+#define COMMAND_HASH_SIZE 256 // Buckets in the command path cache
+#define VARIABLE_HASH_SIZE 256 // Buckets in the shell variable table
+#define ARENA_BLOCK_SIZE 4096 // Bytes per block of the per-command arena
+#define DEFAULT_HISTSIZE 1000 // History entries kept when HISTSIZE is unset
+#define HISTORY_ENTRY_BYTES 128 // Average command length the arena is sized for
+#define HISTORY_INDEX_SLOTS 4096 // Initial trigram slots in the history index
+#define DEFAULT_HISTFILE ".mtl458_history" // History file in $HOME when HISTFILE is unset
+#define CAT_BUFFER_SIZE (128 * 1024) // Fallback copy buffer for 'cat'
+#define CAT_CHUNK_SIZE (1 << 30) // Bytes requested per in-kernel copy call
+#define GREP_BUFFER_SIZE (128 * 1024) // Read size for 'grep' input that can't be mapped
+#define LS_BUFFER_SIZE (256 * 1024) // Bytes of directory entries read per getdents64 call
+#define SUBSTITUTION_READ_SIZE 4096 // Least room offered to each read of $( ) output
+#define DD_BLOCK_SIZE 512 // Default 'dd' block size, as in dd
+#define DD_DIRECT_ALIGN 4096 // Buffer alignment for O_DIRECT transfers
+#define INITIAL_JOBS 16 // Job table entries allocated at first
+#define OUTPUT_BUFFER_SIZE (64 * 1024) // Bytes of the shell's own output held per descriptor
+#define TRACE_BUFFER_SIZE (64 * 1024) // Trace events collected before a write
+#define DEFAULT_TRACEFILE "mtl458_trace.json" // Trace file for 'set -o trace' when TRACEFILE is unset
+#define STATS_BUCKETS 40 // Power-of-two buckets in each 'stats' histogram
+#define DEFAULT_TIMEFORMAT "\nreal\t%3lR\nuser\t%3lU\nsys\t%3lS" // 'time' report when TIMEFORMAT is unset, as in bash
 
 // History storage and tracking
-char **history = NULL; // Command history
-int history_count = 0; // Number of commands in history
-int history_size = 0;  // Capacity of history array
+// Command history: a fixed-capacity ring of entries whose text lives in one
+// circular byte arena, so adding a command never mallocs and dropping the
+// oldest one is O(1)
+typedef struct {
+    size_t offset; // Start of the command text in history_arena
+    size_t length; // Length of the command text, without the terminator
+} history_entry;
+
+history_entry *history = NULL; // Ring of entries, oldest at history_start
+int history_size = 0;          // Capacity of the ring (HISTSIZE)
+int history_start = 0;         // Ring index of the oldest entry
+int history_count = 0;         // Number of commands in history
+char *history_arena = NULL;    // Text of every entry, NUL-terminated
+size_t history_arena_size = 0; // Bytes in the arena
+size_t history_arena_head = 0; // Where the next entry's text goes
+int history_fd = -1;           // HISTFILE opened for appending, or -1
+unsigned long history_first_seq = 0; // Sequence number of the oldest entry
+
+// Trigram index over history for substring search: each trigram maps to the
+// sequence numbers of the entries containing it, oldest first. Entries that
+// have left the ring are skipped lazily and swept out periodically.
+typedef struct {
+    unsigned int trigram;  // Three bytes packed, plus one so that 0 marks a free slot
+    unsigned long *seqs;   // Sequence numbers of entries containing the trigram
+    size_t start;          // First element of seqs that may still be in history
+    size_t count;          // Elements used in seqs
+    size_t capacity;       // Elements allocated in seqs
+} trigram_postings;
+
+trigram_postings *history_index = NULL; // Open-addressed table of trigrams
+size_t history_index_size = 0;          // Slots in the table, a power of two
+size_t history_index_used = 0;          // Slots holding a trigram
+int history_index_appends = 0;          // Entries indexed since the last sweep
 
 // Previous directory for 'cd -' command
 char prev_dir[INITIAL_CMD_SIZE] = ""; // Stores the previous directory
 
-// Add command to history
-void add_to_history(const char *cmd) {
-    // Resize history array if necessary
-    if (history_count >= history_size) {
-        history_size = history_size == 0 ? 100 : history_size * 2;
-        char **new_history = realloc(history, history_size * sizeof(char *));
-        if (new_history == NULL) {
-            printf("Invalid Command\n");
-            exit(EXIT_FAILURE);
-        }
-        history = new_history;
+extern char **environ; // Environment passed to launched commands
+
+int last_status = 0; // Exit status of the last command line
+int exit_requested = 0; // Set by 'exit': run nothing more and leave with last_status
+int capturing_output = 0; // Nesting of $( ) lists running in the shell with stdout captured
+
+// Job table: commands started with '&' and pipelines stopped with Ctrl-Z. Entries
+// are kept in job number order; reaping is driven by SIGCHLD, which only raises
+// children_changed so the table is brought up to date before the next prompt.
+typedef enum {
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE
+} job_state;
+
+typedef struct {
+    int id;                // Job number, shown as [n]
+    pid_t pgid;            // Process group every process of the job runs in
+    pid_t *pids;           // Processes not yet reaped, in pipeline order
+    int pid_count;         // Entries in pids
+    pid_t last_pid;        // Process whose exit status is the job's
+    job_state state;
+    int status;            // Exit status once the last process is reaped
+    unsigned long touched; // When the job was last started, stopped or continued; the newest is %+
+    char *command;         // Command text shown by 'jobs'
+} job;
+
+job *jobs = NULL;      // Live jobs, ordered by id
+int job_count = 0;     // Entries used in jobs
+int job_capacity = 0;  // Entries allocated in jobs
+unsigned long job_clock = 0; // Source of job touched stamps
+int shell_interactive = 0;   // Whether this shell does job control (stdin is its terminal)
+pid_t shell_pgid = 0;        // The shell's process group, given the terminal back after each job
+volatile sig_atomic_t children_changed = 0; // Set by SIGCHLD: some child exited, stopped or continued
+
+// Command path cache, like bash's 'hash': name -> absolute path resolved from PATH
+typedef struct command_hash_entry {
+    char *name;                      // Command name as typed
+    char *path;                      // Absolute path it resolved to
+    int hits;                        // Times the cached path was used
+    struct command_hash_entry *next; // Next entry in the same bucket
+} command_hash_entry;
+
+command_hash_entry *command_hash[COMMAND_HASH_SIZE]; // Hash buckets
+char *command_hash_path = NULL; // Value of PATH the cache was built against
+
+// Shell variables, chained in hash buckets like the command path cache. The
+// exported ones are mirrored into the environment, so launched commands and
+// the getenv lookups for PATH and the like see them.
+typedef struct variable {
+    char *name;
+    char *value;
+    int exported;          // Passed on to launched commands
+    struct variable *next; // Next variable in the same bucket
+} variable;
+
+variable *variables[VARIABLE_HASH_SIZE];
+pid_t shell_pid = 0;            // $$: the shell's pid, also in its subshells
+const char *shell_name = "";    // $0
+pid_t last_background_pid = 0;  // $!: the most recent background job
+
+// Shell output. Whatever the shell prints itself goes through a buffer per
+// descriptor rather than stdio, and reaches the descriptor in as few write calls
+// as possible: when a buffer fills, and at flush_output, which runs at the prompt,
+// before every fork and spawn (so a child never inherits unwritten output and
+// prints it a second time), before the shell's descriptors are redirected, and
+// before a builtin blocks reading a pipe or terminal. stderr is also written out
+// at the end of each message, after any pending stdout, to keep them in order.
+typedef struct {
+    int fd;
+    size_t len;
+    char data[OUTPUT_BUFFER_SIZE];
+} output_buffer;
+
+output_buffer shell_stdout = { STDOUT_FILENO, 0, "" };
+output_buffer shell_stderr = { STDERR_FILENO, 0, "" };
+
+// Write all of buf to fd, retrying short writes
+int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+void flush_buffer(output_buffer *out) {
+    if (out->len > 0) {
+        write_all(out->fd, out->data, out->len); // Nowhere to report a failure
+        out->len = 0;
+    }
+}
+
+// Write out everything the shell has printed so far
+void flush_output() {
+    flush_buffer(&shell_stdout);
+    flush_buffer(&shell_stderr);
+}
+
+// Add len bytes to a buffer; a block at least as big as the buffer is written
+// straight from where it is
+void buffer_write(output_buffer *out, const char *text, size_t len) {
+    if (len > sizeof(out->data) - out->len) {
+        flush_buffer(out);
+    }
+    if (len >= sizeof(out->data)) {
+        write_all(out->fd, text, len);
+        return;
+    }
+    memcpy(out->data + out->len, text, len);
+    out->len += len;
+}
+
+// Format straight into a buffer's free room; only when that is too small is it
+// flushed and the text formatted again, on the heap if it outgrows the buffer
+void buffer_vprintf(output_buffer *out, const char *format, va_list args) {
+    va_list again;
+    va_copy(again, args);
+    size_t room = sizeof(out->data) - out->len;
+    int len = vsnprintf(out->data + out->len, room, format, args);
+    if (len >= 0 && (size_t)len < room) {
+        out->len += len;
+    } else if (len >= 0) {
+        flush_buffer(out);
+        if ((size_t)len < sizeof(out->data)) {
+            vsnprintf(out->data, sizeof(out->data), format, again);
+            out->len = len;
+        } else {
+            char *text = malloc(len + 1);
+            if (text != NULL) {
+                vsnprintf(text, len + 1, format, again);
+                write_all(out->fd, text, len);
+                free(text);
+            }
+        }
+    }
+    va_end(again);
+}
+
+// printf onto the shell's stdout
+void out_printf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    buffer_vprintf(&shell_stdout, format, args);
+    va_end(args);
+}
+
+void out_putc(char c) {
+    if (shell_stdout.len == sizeof(shell_stdout.data)) {
+        flush_buffer(&shell_stdout);
+    }
+    shell_stdout.data[shell_stdout.len++] = c;
+}
+
+void out_write(const char *text, size_t len) {
+    buffer_write(&shell_stdout, text, len);
+}
+
+// Write stderr out when a message is complete (ends with a newline)
+void end_error_message() {
+    if (shell_stderr.len > 0 && shell_stderr.data[shell_stderr.len - 1] == '\n') {
+        flush_buffer(&shell_stderr);
+    }
+}
+
+// printf onto the shell's stderr
+void err_printf(const char *format, ...) {
+    flush_buffer(&shell_stdout);
+    va_list args;
+    va_start(args, format);
+    buffer_vprintf(&shell_stderr, format, args);
+    va_end(args);
+    end_error_message();
+}
+
+void err_write(const char *text, size_t len) {
+    flush_buffer(&shell_stdout);
+    buffer_write(&shell_stderr, text, len);
+    end_error_message();
+}
+
+void err_putc(char c) {
+    err_write(&c, 1);
+}
+
+// Set up an empty history holding at most capacity commands
+void init_history(int capacity) {
+    history_size = capacity;
+    history = malloc((capacity > 0 ? capacity : 1) * sizeof(history_entry));
+    history_arena_size = (capacity > 0 ? capacity : 1) * HISTORY_ENTRY_BYTES;
+    history_arena = malloc(history_arena_size);
+    if (history == NULL || history_arena == NULL) {
+        out_printf("Invalid Command\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Text of the i-th oldest command still in history
+const char *history_at(int i) {
+    return history_arena + history[(history_start + i) % history_size].offset;
+}
+
+// Drop the oldest command in O(1)
+void drop_oldest_history() {
+    history_start = (history_start + 1) % history_size;
+    history_first_seq++;
+    history_count--;
+    if (history_count == 0) {
+        history_start = 0;
+        history_arena_head = 0;
+    }
+}
+
+// Pack three bytes of text into a trigram key
+unsigned int pack_trigram(const char *text) {
+    return (((unsigned char)text[0] << 16) | ((unsigned char)text[1] << 8) | (unsigned char)text[2]) + 1;
+}
+
+// Find the slot for a trigram: the one holding it, or the free slot where it belongs
+trigram_postings *find_trigram_slot(unsigned int trigram) {
+    size_t mask = history_index_size - 1;
+    size_t slot = (trigram * 2654435761u) & mask;
+    while (history_index[slot].trigram != 0 && history_index[slot].trigram != trigram) {
+        slot = (slot + 1) & mask;
+    }
+    return &history_index[slot];
+}
+
+// Double the trigram table, keeping every posting list
+void grow_history_index() {
+    trigram_postings *old_index = history_index;
+    size_t old_size = history_index_size;
+    history_index_size = old_size ? old_size * 2 : HISTORY_INDEX_SLOTS;
+    history_index = calloc(history_index_size, sizeof(trigram_postings));
+    if (history_index == NULL) {
+        out_printf("Invalid Command\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < old_size; i++) {
+        if (old_index[i].trigram != 0) {
+            *find_trigram_slot(old_index[i].trigram) = old_index[i];
+        }
+    }
+    free(old_index);
+}
+
+// Forget sequence numbers of entries that have left the ring
+void prune_postings(trigram_postings *postings) {
+    while (postings->start < postings->count && postings->seqs[postings->start] < history_first_seq) {
+        postings->start++;
+    }
+    if (postings->start == postings->count) {
+        postings->start = 0;
+        postings->count = 0;
+    } else if (postings->start > postings->count / 2) {
+        memmove(postings->seqs, postings->seqs + postings->start, (postings->count - postings->start) * sizeof(unsigned long));
+        postings->count -= postings->start;
+        postings->start = 0;
+    }
+}
+
+// Add an entry's trigrams to the index
+void index_history_entry(const char *text, size_t length, unsigned long seq) {
+    for (size_t i = 0; i + 3 <= length; i++) {
+        if ((history_index_used + 1) * 2 > history_index_size) {
+            grow_history_index();
+        }
+        unsigned int trigram = pack_trigram(text + i);
+        trigram_postings *postings = find_trigram_slot(trigram);
+        if (postings->trigram == 0) {
+            postings->trigram = trigram;
+            history_index_used++;
+        }
+        if (postings->count > 0 && postings->seqs[postings->count - 1] == seq) {
+            continue; // Trigram repeats within this entry
+        }
+        prune_postings(postings);
+        if (postings->count == postings->capacity) {
+            size_t capacity = postings->capacity ? postings->capacity * 2 : 4;
+            unsigned long *seqs = realloc(postings->seqs, capacity * sizeof(unsigned long));
+            if (seqs == NULL) {
+                out_printf("Invalid Command\n");
+                exit(EXIT_FAILURE);
+            }
+            postings->seqs = seqs;
+            postings->capacity = capacity;
+        }
+        postings->seqs[postings->count++] = seq;
+    }
+
+    // Lists of trigrams that stop appearing are only pruned by a sweep; one per
+    // history_size entries keeps the index proportional to the live history
+    if (++history_index_appends >= history_size) {
+        history_index_appends = 0;
+        for (size_t i = 0; i < history_index_size; i++) {
+            if (history_index[i].trigram != 0) {
+                prune_postings(&history_index[i]);
+            }
+        }
+    }
+}
+
+// Choose which entries to check for pattern: *candidates is set to the shortest
+// posting list among the pattern's trigrams, or NULL when every entry must be
+// checked (patterns under three bytes). Returns 0 if nothing can match.
+int history_candidates(const char *pattern, trigram_postings **candidates) {
+    size_t length = strlen(pattern);
+    *candidates = NULL;
+    if (length < 3) {
+        return 1;
+    }
+    if (history_index == NULL) {
+        return 0;
+    }
+    for (size_t i = 0; i + 3 <= length; i++) {
+        trigram_postings *postings = find_trigram_slot(pack_trigram(pattern + i));
+        if (postings->trigram == 0) {
+            return 0;
+        }
+        prune_postings(postings);
+        if (postings->count == 0) {
+            return 0;
+        }
+        if (*candidates == NULL || postings->count - postings->start < (*candidates)->count - (*candidates)->start) {
+            *candidates = postings;
+        }
+    }
+    return 1;
+}
+
+// Newest history position below before whose command contains pattern, or -1
+int find_history_match(const char *pattern, int before) {
+    trigram_postings *candidates;
+    if (!history_candidates(pattern, &candidates)) {
+        return -1;
+    }
+    if (candidates == NULL) {
+        for (int i = before - 1; i >= 0; i--) {
+            if (strstr(history_at(i), pattern) != NULL) {
+                return i;
+            }
+        }
+        return -1;
+    }
+    for (size_t j = candidates->count; j > candidates->start; j--) {
+        int i = (int)(candidates->seqs[j - 1] - history_first_seq);
+        if (i < before && strstr(history_at(i), pattern) != NULL) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Print every history command containing pattern, oldest first; returns how many matched
+int print_history_matches(const char *pattern) {
+    trigram_postings *candidates;
+    int matches = 0;
+    if (!history_candidates(pattern, &candidates)) {
+        return 0;
+    }
+    if (candidates == NULL) {
+        for (int i = 0; i < history_count; i++) {
+            if (strstr(history_at(i), pattern) != NULL) {
+                out_printf("%s\n", history_at(i));
+                matches++;
+            }
+        }
+        return matches;
+    }
+    for (size_t j = candidates->start; j < candidates->count; j++) {
+        const char *cmd = history_at((int)(candidates->seqs[j] - history_first_seq));
+        if (strstr(cmd, pattern) != NULL) {
+            out_printf("%s\n", cmd);
+            matches++;
+        }
+    }
+    return matches;
+}
+
+// Grow the arena to hold at least needed bytes, packing the entries at its start
+void grow_history_arena(size_t needed) {
+    size_t new_size = history_arena_size;
+    while (new_size < needed) {
+        new_size *= 2;
+    }
+    char *new_arena = malloc(new_size);
+    if (new_arena == NULL) {
+        out_printf("Invalid Command\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t head = 0;
+    for (int i = 0; i < history_count; i++) {
+        history_entry *entry = &history[(history_start + i) % history_size];
+        memcpy(new_arena + head, history_arena + entry->offset, entry->length + 1);
+        entry->offset = head;
+        head += entry->length + 1;
+    }
+    free(history_arena);
+    history_arena = new_arena;
+    history_arena_size = new_size;
+    history_arena_head = head;
+}
+
+// Store length bytes of text as the newest history entry
+void store_history(const char *text, size_t length) {
+    if (history_size == 0) {
+        return; // HISTSIZE=0 keeps nothing
+    }
+    if (history_count == history_size) {
+        drop_oldest_history();
+    }
+
+    // Find room for the text in the circular arena. Text never wraps: if it doesn't
+    // fit before the end, it starts again at 0. Only when the live entries leave no
+    // gap big enough is the arena compacted into a larger one.
+    size_t needed = length + 1;
+    size_t offset = 0;
+    size_t tail = history_count > 0 ? history[history_start].offset : 0; // Start of the oldest text
+    if (history_count == 0 && needed <= history_arena_size) {
+        offset = 0;
+    } else if (history_count > 0 && history_arena_head > tail && history_arena_size - history_arena_head >= needed) {
+        offset = history_arena_head;
+    } else if (history_count > 0 && history_arena_head > tail && tail >= needed) {
+        offset = 0;
+    } else if (history_count > 0 && history_arena_head <= tail && tail - history_arena_head >= needed) {
+        offset = history_arena_head;
+    } else {
+        grow_history_arena(history_arena_size + needed);
+        offset = history_arena_head;
+    }
+
+    memcpy(history_arena + offset, text, length);
+    history_arena[offset + length] = '\0';
+    history_entry *entry = &history[(history_start + history_count) % history_size];
+    entry->offset = offset;
+    entry->length = needed - 1;
+    history_arena_head = offset + needed;
+    index_history_entry(history_arena + offset, length, history_first_seq + history_count);
+    history_count++;
+}
+
+// Add command to history, appending it to HISTFILE as well.
+// The line goes out in a single O_APPEND write, so shells sharing the file never interleave.
+void add_to_history(const char *cmd) {
+    size_t length = strlen(cmd);
+    store_history(cmd, length);
+
+    if (history_fd != -1) {
+        struct iovec line[2] = {
+            { (void *)cmd, length },
+            { "\n", 1 },
+        };
+        writev(history_fd, line, 2);
+    }
+}
+
+// Load the last history_size lines of a history file and keep it open for appending.
+// The file is mmap'd and scanned backwards from the end, so only the tail is touched
+// no matter how large it has grown.
+void load_history_file(const char *path) {
+    int missing_newline = 0; // Whether the file ends in a partial line
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0 && history_size > 0) {
+            size_t size = st.st_size;
+            char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                // Walk back over history_size lines; a missing final newline still ends a line
+                size_t start = size;
+                if (data[start - 1] == '\n') {
+                    start--;
+                } else {
+                    missing_newline = 1;
+                }
+                int lines = 0;
+                while (start > 0 && lines < history_size) {
+                    char *newline = memrchr(data, '\n', start);
+                    start = newline ? (size_t)(newline - data) : 0;
+                    lines++;
+                }
+                if (data[start] == '\n') {
+                    start++;
+                }
+
+                // Index the lines from there forward
+                while (start < size) {
+                    char *newline = memchr(data + start, '\n', size - start);
+                    size_t end = newline ? (size_t)(newline - data) : size;
+                    if (end > start) {
+                        store_history(data + start, end - start);
+                    }
+                    start = end + 1;
+                }
+                munmap(data, size);
+            }
+        }
+        close(fd);
+    }
+
+    history_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (history_fd != -1 && missing_newline) {
+        write(history_fd, "\n", 1); // Don't glue our first command onto the partial line
+    }
+}
+
+// Print the last count commands of history (all of them if count is larger)
+void print_history(int count) {
+    if (count > history_count) {
+        count = history_count;
+    }
+    for (int i = history_count - count; i < history_count; i++) {
+        out_printf("%s\n", history_at(i));
+    }
+}
+
+// 'history [N]' and 'history -s PATTERN' builtin; returns 0 on success,
+// 1 on a bad argument or when a search finds nothing
+int history_command(char **args) {
+    int count = history_count;
+    if (args[1] != NULL && strcmp(args[1], "-s") == 0) {
+        if (args[2] == NULL) {
+            out_printf("Invalid Command\n");
+            return 1;
+        }
+        return print_history_matches(args[2]) > 0 ? 0 : 1;
+    }
+    if (args[1] != NULL) {
+        char *end;
+        long value = strtol(args[1], &end, 10);
+        if (*end != '\0' || end == args[1] || value < 0) {
+            out_printf("Invalid Command\n");
+            return 1;
+        }
+        if (value < count) {
+            count = (int)value;
+        }
+    }
+    print_history(count);
+    return 0;
+}
+
+// Release everything history owns
+void free_history() {
+    if (history_fd != -1) {
+        close(history_fd);
+        history_fd = -1;
+    }
+    for (size_t i = 0; i < history_index_size; i++) {
+        free(history_index[i].seqs);
+    }
+    free(history_index);
+    history_index = NULL;
+    history_index_size = 0;
+    history_index_used = 0;
+    free(history);
+    free(history_arena);
+    history = NULL;
+    history_arena = NULL;
+    history_count = 0;
+}
+
+// Copy everything from in_fd to out_fd, keeping the data inside the kernel when the
+// fd types allow it: copy_file_range between files, sendfile from a file, splice
+// through a pipe. Falls back to large read/write calls. Returns 0, or -1 on error.
+int copy_fd(int in_fd, int out_fd) {
+    struct stat in_st, out_st;
+    if (fstat(in_fd, &in_st) != 0 || fstat(out_fd, &out_st) != 0) {
+        return -1;
+    }
+    ssize_t n;
+
+    if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+        while ((n = copy_file_range(in_fd, NULL, out_fd, NULL, CAT_CHUNK_SIZE, 0)) > 0) {
+        }
+        if (n == 0) {
+            return 0;
+        }
+        // EBADF here means out_fd is O_APPEND, which copy_file_range refuses
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF) {
+            return -1;
+        }
+    }
+
+    if (S_ISREG(in_st.st_mode)) {
+        while ((n = sendfile(out_fd, in_fd, NULL, CAT_CHUNK_SIZE)) > 0) {
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (errno != EINVAL && errno != ENOSYS) {
+            return -1;
+        }
+    }
+
+    if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)) {
+        while ((n = splice(in_fd, NULL, out_fd, NULL, CAT_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0) {
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (errno != EINVAL && errno != ENOSYS) {
+            return -1;
+        }
+    }
+
+    // Whatever the kernel paths copied already moved the file offsets, so just continue
+    char *buffer = malloc(CAT_BUFFER_SIZE);
+    if (buffer == NULL) {
+        return -1;
+    }
+    int result = 0;
+    while (1) {
+        n = read(in_fd, buffer, CAT_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            result = n == 0 ? 0 : -1;
+            break;
+        }
+        if (write_all(out_fd, buffer, n) != 0) {
+            result = -1;
+            break;
+        }
+    }
+    free(buffer);
+    return result;
+}
+
+// 'cat' builtin: copy each file (or in_fd when there are none, or for "-") to out_fd.
+// Returns 0 if every file was copied, 1 otherwise.
+int cat_files(char **args, int in_fd, int out_fd) {
+    int status = 0;
+    if (args[1] == NULL) {
+        if (copy_fd(in_fd, out_fd) != 0) {
+            err_printf("cat: %s\n", strerror(errno));
+            status = 1;
+        }
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-") == 0) {
+            if (copy_fd(in_fd, out_fd) != 0) {
+                err_printf("cat: %s\n", strerror(errno));
+                status = 1;
+            }
+            continue;
+        }
+
+        int file_fd = open(args[i], O_RDONLY | O_CLOEXEC);
+        if (file_fd == -1) {
+            err_printf("cat: %s\n", strerror(errno)); // Print the standard error message
+            status = 1;
+            continue;
+        }
+        if (copy_fd(file_fd, out_fd) != 0) {
+            err_printf("cat: %s\n", strerror(errno));
+            status = 1;
+        }
+        close(file_fd);
+    }
+    if (isatty(out_fd)) {
+        write_all(out_fd, "\n", 1); // Add newline after file content so the prompt starts cleanly
+    }
+    return status;
+}
+
+// Handle 'cat' as a builtin: files, or stdin when there are none
+int cat_command(char **args) {
+    flush_output(); // cat writes to the descriptor directly
+    return cat_files(args, STDIN_FILENO, STDOUT_FILENO);
+}
+
+// Per-command scratch memory: blocks are carved up by arena_alloc and all
+// released at once by arena_reset when the command is done
+typedef struct arena_block {
+    struct arena_block *next; // Older block
+    size_t size;              // Usable bytes in data
+    size_t used;              // Bytes handed out so far
+    char data[];              // The memory itself
+} arena_block;
+
+typedef struct {
+    arena_block *blocks; // Newest block first
+} arena;
+
+arena command_arena; // Holds the tokens and argv arrays of the running command
+
+// Allocate size bytes from the arena
+void *arena_alloc(arena *a, size_t size) {
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1); // Keep pointers aligned
+    arena_block *block = a->blocks;
+    if (block == NULL || block->size - block->used < size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(arena_block) + block_size);
+        if (block == NULL) {
+            out_printf("Invalid Command\n");
+            exit(EXIT_FAILURE);
+        }
+        block->next = a->blocks;
+        block->size = block_size;
+        block->used = 0;
+        a->blocks = block;
+    }
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+// Release everything allocated from the arena, keeping its first block for reuse
+void arena_reset(arena *a) {
+    while (a->blocks != NULL && a->blocks->next != NULL) {
+        arena_block *next = a->blocks->next;
+        free(a->blocks);
+        a->blocks = next;
+    }
+    if (a->blocks != NULL) {
+        a->blocks->used = 0;
+    }
+}
+
+// Free every block of the arena
+void arena_free(arena *a) {
+    arena_reset(a);
+    free(a->blocks);
+    a->blocks = NULL;
+}
+
+// Token kinds produced by tokenize
+typedef enum {
+    TOKEN_WORD,   // An argument, quotes and escapes already removed
+    TOKEN_PIPE,   // |
+    TOKEN_AND,    // &&
+    TOKEN_OR,     // ||
+    TOKEN_SEMI,   // ;
+    TOKEN_AMP,    // &
+    TOKEN_LPAREN, // (
+    TOKEN_RPAREN, // )
+    TOKEN_LESS,      // [n]<  input from a file
+    TOKEN_GREAT,     // [n]>  output to a file
+    TOKEN_DGREAT,    // [n]>> append to a file
+    TOKEN_LESSAND,   // [n]<& duplicate (or close with -) an input descriptor
+    TOKEN_GREATAND,  // [n]>& duplicate (or close with -) an output descriptor
+    TOKEN_TLESS      // [n]<<< here-string
+} token_type;
+
+typedef struct {
+    token_type type;
+    char *text;    // Word text inside the command line, NULL for operators
+    char *pattern; // The word as a glob pattern, quoted characters escaped with '\\';
+                   // NULL unless it has an unquoted * ? or [
+    char *raw;     // The word as written, quotes and all, when it has a $ or ~ to
+                   // expand before it runs; NULL otherwise
+    int assignment; // The word starts with an unquoted NAME=
+    int fd;        // Descriptor a redirection applies to, -1 for the operator's default
+} token;
+
+// A redirection attached to a command, in the order it was written
+typedef struct {
+    token_type type; // One of the redirection tokens
+    int fd;          // Descriptor being redirected
+    char *target;    // File name, descriptor number, '-' or here-string text
+    char *raw;       // The target as written when it needs expanding, else NULL
+} redirect;
+
+// One step of descriptor setup for a child or a builtin: make fd refer to what
+// source refers to, or close fd when source is -1. Steps run in order.
+typedef struct {
+    int fd;     // Descriptor being set up
+    int source; // Descriptor to duplicate onto it, or -1 to close it
+    int owned;  // Whether source was opened for this command and must be closed after
+} fd_action;
+
+// Kinds of node in a parsed command line
+typedef enum {
+    NODE_COMMAND,    // A simple command
+    NODE_PIPELINE,   // Commands joined by |
+    NODE_AND,        // left && right
+    NODE_OR,         // left || right
+    NODE_SEQUENCE,   // left ; right
+    NODE_SUBSHELL,   // ( left ), run in a child process
+    NODE_BACKGROUND  // left &, run as a job without waiting for it
+} node_type;
+
+typedef struct command_node {
+    node_type type;
+    char **argv;                  // NODE_COMMAND: NULL-terminated arguments
+    token *words;                 // NODE_COMMAND: the word behind each argument, NULL if none has a
+                                  // pattern to glob or a raw form to expand
+    struct command_node **stages; // NODE_PIPELINE: the commands, first to last
+    int stage_count;              // NODE_PIPELINE: number of stages
+    struct command_node *left;    // Operands of AND/OR/SEQUENCE, body of SUBSHELL/BACKGROUND
+    struct command_node *right;
+    redirect *redirects;          // NODE_COMMAND/NODE_SUBSHELL: redirections, in order
+    int redirect_count;           // Number of redirections
+    int timed;                    // 'time' before the pipeline: TIME_REPORT or TIME_POSIX, else 0
+    int assignments;              // NODE_COMMAND: how many of the first words are NAME=value
+} command_node;
+
+#define TIME_REPORT 1 // 'time': TIMEFORMAT, or bash's format plus a per-stage breakdown
+#define TIME_POSIX 2  // 'time -p': the POSIX format
+
+int execute_node(command_node *node);
+command_node *parse_command_line(token *tokens, int count);
+
+// Recognise an operator whose first character is first (passed separately because
+// the lexer may already have overwritten it) followed by rest; returns its length,
+// or 0 if none starts here
+int lex_operator(char first, const char *rest, token_type *type) {
+    switch (first) {
+    case '|':
+        *type = rest[0] == '|' ? TOKEN_OR : TOKEN_PIPE;
+        return rest[0] == '|' ? 2 : 1;
+    case '&':
+        *type = rest[0] == '&' ? TOKEN_AND : TOKEN_AMP;
+        return rest[0] == '&' ? 2 : 1;
+    case ';':
+        *type = TOKEN_SEMI;
+        return 1;
+    case '(':
+        *type = TOKEN_LPAREN;
+        return 1;
+    case ')':
+        *type = TOKEN_RPAREN;
+        return 1;
+    case '<':
+        if (rest[0] == '<' && rest[1] == '<') {
+            *type = TOKEN_TLESS;
+            return 3;
+        }
+        *type = rest[0] == '&' ? TOKEN_LESSAND : TOKEN_LESS;
+        return rest[0] == '&' ? 2 : 1;
+    case '>':
+        if (rest[0] == '>') {
+            *type = TOKEN_DGREAT;
+            return 2;
+        }
+        *type = rest[0] == '&' ? TOKEN_GREATAND : TOKEN_GREAT;
+        return rest[0] == '&' ? 2 : 1;
+    default:
+        return 0;
+    }
+}
+
+// Whether a '$' followed by c starts an expansion: $NAME, ${NAME}, $(list), $0-$9,
+// $?, $$, $! or $#. Any other '$' is an ordinary character.
+int starts_expansion(char c) {
+    return c != '\0' && (isalnum((unsigned char)c) || strchr("_{(?$!#", c) != NULL);
+}
+
+// Skip the command list of a $( ... ) whose '(' is at p, minding quotes and nested
+// parentheses; returns the position past its ')', or NULL if it never closes
+const char *skip_substitution(const char *p) {
+    int depth = 0;
+    while (*p != '\0') {
+        if (*p == '\\') {
+            p += p[1] != '\0' ? 2 : 1;
+            continue;
+        }
+        if (*p == '\'') {
+            p = strchr(p + 1, '\'');
+            if (p == NULL) {
+                return NULL;
+            }
+        } else if (*p == '"') {
+            for (p++; *p != '"'; p++) {
+                if (*p == '\0') {
+                    return NULL;
+                } else if (*p == '\\' && p[1] != '\0') {
+                    p++;
+                } else if (*p == '$' && p[1] == '(') {
+                    p = skip_substitution(p + 1);
+                    if (p == NULL) {
+                        return NULL;
+                    }
+                    p--;
+                }
+            }
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p + 1;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+// Split a command line into tokens in a single pass. Words are unquoted in place
+// inside line, which only ever shrinks them, so no argument is copied; the token
+// array comes from the arena. Single quotes are literal, double quotes let a
+// backslash escape $ ` " \ and newline, and a bare backslash escapes any character.
+// A word with an unquoted * ? or [ also gets a copy for glob expansion, with its
+// quoted characters escaped so they still match only themselves. A word with
+// something to expand ($ or ~) keeps its raw source instead, for expand_word;
+// a $( ... ) inside it is taken whole, spaces and operators included.
+// Returns the number of tokens, or -1 on an unterminated quote or $(.
+int tokenize(char *line, arena *a, token **tokens_out) {
+    int capacity = 16;
+    int count = 0;
+    token *tokens = arena_alloc(a, capacity * sizeof(token));
+    char *read = line;
+    char *write = line;
+    // Room for every word as a pattern, at worst every character escaped; only
+    // lines that could hold one pay for it
+    char *pattern = strpbrk(line, "*?[") != NULL ? arena_alloc(a, 2 * strlen(line) + 1) : NULL;
+    // Unquoting overwrites the line, so words with expansions need the original
+    char *source = NULL;
+    if (strpbrk(line, "$~") != NULL) {
+        size_t length = strlen(line);
+        source = arena_alloc(a, length + 1);
+        memcpy(source, line, length + 1);
+    }
+
+    while (1) {
+        while (*read == ' ' || *read == '\t' || *read == '\n') {
+            read++;
+        }
+        if (*read == '\0') {
+            break;
+        }
+
+        if (count == capacity) {
+            token *grown = arena_alloc(a, 2 * capacity * sizeof(token));
+            memcpy(grown, tokens, count * sizeof(token));
+            tokens = grown;
+            capacity *= 2;
+        }
+
+        // A run of digits right before < or > names the descriptor to redirect
+        int io_number = -1;
+        char *digits_end = read;
+        while (*digits_end >= '0' && *digits_end <= '9' && digits_end - read < 4) {
+            digits_end++;
+        }
+        if (digits_end > read && (*digits_end == '<' || *digits_end == '>')) {
+            io_number = atoi(read);
+            read = digits_end;
+        }
+
+        token_type type;
+        int op_length = lex_operator(*read, read + 1, &type);
+        if (op_length > 0) {
+            tokens[count].type = type;
+            tokens[count].text = NULL;
+            tokens[count].pattern = NULL;
+            tokens[count].raw = NULL;
+            tokens[count].assignment = 0;
+            tokens[count].fd = io_number;
+            count++;
+            read += op_length;
+            continue;
+        }
+
+        char *start = write;
+        char *pattern_start = pattern;
+        char *word_source = read;
+        int globbing = 0;
+        int expanding = 0;
+        // NAME= at its start, before any quoting, makes the word an assignment
+        char *name_end = read;
+        while (isalnum((unsigned char)*name_end) || *name_end == '_') {
+            name_end++;
+        }
+        int assignment = *name_end == '=' && name_end > read && !isdigit((unsigned char)*read);
+        while (*read != '\0' && *read != ' ' && *read != '\t' && *read != '\n' && lex_operator(*read, read + 1, &type) == 0) {
+            char *from = write;
+            if (*read == '\'') {
+                read++;
+                while (*read != '\0' && *read != '\'') {
+                    *write++ = *read++;
+                }
+                if (*read == '\0') {
+                    return -1;
+                }
+                read++;
+            } else if (*read == '"') {
+                read++;
+                while (*read != '\0' && *read != '"') {
+                    if (*read == '$' && starts_expansion(read[1])) {
+                        expanding = 1;
+                        if (read[1] == '(') {
+                            const char *end = skip_substitution(read + 1);
+                            if (end == NULL) {
+                                return -1;
+                            }
+                            while (read < end) {
+                                *write++ = *read++;
+                            }
+                            continue;
+                        }
+                    }
+                    if (*read == '\\' && read[1] != '\0' && strchr("$`\"\\\n", read[1]) != NULL) {
+                        read++;
+                    }
+                    *write++ = *read++;
+                }
+                if (*read == '\0') {
+                    return -1;
+                }
+                read++;
+            } else if (*read == '\\') {
+                read++;
+                if (*read != '\0') {
+                    *write++ = *read++;
+                }
+            } else if (*read == '$' && read[1] == '(') {
+                const char *end = skip_substitution(read + 1);
+                if (end == NULL) {
+                    return -1;
+                }
+                expanding = 1;
+                while (read < end) {
+                    *write++ = *read++;
+                }
+                continue;
+            } else {
+                expanding |= *read == '~' || (*read == '$' && starts_expansion(read[1]));
+                globbing |= *read == '*' || *read == '?' || *read == '[';
+                if (pattern != NULL) {
+                    *pattern++ = *read;
+                }
+                *write++ = *read++;
+                continue;
+            }
+            for (; pattern != NULL && from < write; from++) { // Quoted: escape what a pattern would read
+                if (strchr("*?[]\\", *from) != NULL) {
+                    *pattern++ = '\\';
+                }
+                *pattern++ = *from;
+            }
+        }
+
+        // Terminating the word may overwrite the character that ended it, so keep it
+        char stop = *read;
+        *write++ = '\0';
+        tokens[count].type = TOKEN_WORD;
+        tokens[count].text = start;
+        tokens[count].pattern = NULL;
+        tokens[count].raw = NULL;
+        tokens[count].assignment = assignment;
+        tokens[count].fd = -1;
+        count++;
+        if (expanding) {
+            size_t length = read - word_source;
+            char *raw = arena_alloc(a, length + 1);
+            memcpy(raw, source + (word_source - line), length);
+            raw[length] = '\0';
+            tokens[count - 1].raw = raw;
+        }
+        if (globbing) {
+            *pattern++ = '\0';
+            tokens[count - 1].pattern = pattern_start;
+        } else {
+            pattern = pattern_start; // Reuse the room for the next word
+        }
+
+        if (stop == '\0') {
+            break;
+        }
+        op_length = lex_operator(stop, read + 1, &type);
+        if (op_length > 0) {
+            if (count == capacity) {
+                token *grown = arena_alloc(a, 2 * capacity * sizeof(token));
+                memcpy(grown, tokens, count * sizeof(token));
+                tokens = grown;
+                capacity *= 2;
+            }
+            tokens[count].type = type;
+            tokens[count].text = NULL;
+            tokens[count].pattern = NULL;
+            tokens[count].raw = NULL;
+            tokens[count].assignment = 0;
+            tokens[count].fd = -1;
+            count++;
+            read += op_length;
+        } else {
+            read++; // Whitespace
+        }
+    }
+
+    *tokens_out = tokens;
+    return count;
+}
+
+// Pathname expansion. A pattern is split at '/' and each component compiled into
+// steps once; the walk then reads every directory it visits in a single pass of
+// getdents64, however many components or "**" levels look at it. A component
+// that is exactly "**" matches any number of directories, as bash's globstar,
+// and doesn't follow symlinks. Dot files only match a component starting with a
+// '.', and "." and ".." never match. A pattern without any match stays as written.
+typedef enum {
+    GLOB_CHAR, // One given character
+    GLOB_ANY,  // ?: any character
+    GLOB_STAR, // *: any run of characters
+    GLOB_SET   // [...]: one character of a set
+} glob_op;
+
+typedef struct {
+    glob_op op;
+    unsigned char c; // GLOB_CHAR: the character
+    uint64_t *set;   // GLOB_SET: bitmap of the byte values it matches
+} glob_step;
+
+typedef struct {
+    glob_step *steps;
+    int count;
+    char *name;   // The component unescaped, when it has no wildcards; else NULL
+    int globstar; // The component is "**"
+    int dot;      // Starts with a literal '.', so may match dot files
+} glob_component;
+
+// A directory being walked, read at most once
+typedef struct {
+    int fd;
+    char *prefix;             // Path of the directory as results show it: "" or ending in '/'
+    size_t prefix_len;
+    struct dirent64 **entries; // Once listed: its entries, without "." and ".."
+    size_t count;
+    int listed;
+    int reached;              // How the walk got here: GLOB_BY_NAME, GLOB_BY_PATTERN or GLOB_BY_GLOBSTAR
+} glob_dir;
+
+#define GLOB_BY_NAME 0     // The start, or a component without wildcards
+#define GLOB_BY_PATTERN 1  // A component with wildcards
+#define GLOB_BY_GLOBSTAR 2 // "**" going down
+
+// Paths matched for a command, in a malloc'd array that doubles as it grows
+typedef struct {
+    char **items;
+    size_t count;
+    size_t cap;
+} glob_results;
+
+void add_glob_result(glob_results *out, char *path) {
+    if (out->count == out->cap) {
+        size_t cap = out->cap > 0 ? out->cap * 2 : 64;
+        char **grown = realloc(out->items, cap * sizeof(char *));
+        if (grown == NULL) {
+            out_printf("Invalid Command\n");
+            exit(EXIT_FAILURE);
+        }
+        out->items = grown;
+        out->cap = cap;
+    }
+    out->items[out->count++] = path;
+}
+
+// Compile the bracket expression after a '[' into set; returns the position past
+// its ']', or NULL when it never closes and the '[' is an ordinary character
+const char *compile_glob_set(const char *p, uint64_t *set) {
+    static const struct {
+        const char *name;
+        int (*test)(int);
+    } classes[] = {
+        { "alnum", isalnum }, { "alpha", isalpha }, { "blank", isblank }, { "cntrl", iscntrl },
+        { "digit", isdigit }, { "graph", isgraph }, { "lower", islower }, { "print", isprint },
+        { "punct", ispunct }, { "space", isspace }, { "upper", isupper }, { "xdigit", isxdigit }
+    };
+    int negate = *p == '!' || *p == '^';
+    p += negate;
+    memset(set, 0, 4 * sizeof(uint64_t));
+    const char *first = p;
+    while (*p != '\0' && (*p != ']' || p == first)) { // A ']' first is one of the set
+        if (p[0] == '[' && p[1] == ':') {
+            const char *end = strstr(p + 2, ":]");
+            size_t i = 0;
+            while (end != NULL && i < sizeof(classes) / sizeof(classes[0]) &&
+                   !(strlen(classes[i].name) == (size_t)(end - p - 2) && strncmp(classes[i].name, p + 2, end - p - 2) == 0)) {
+                i++;
+            }
+            if (end != NULL && i < sizeof(classes) / sizeof(classes[0])) {
+                for (int c = 0; c < 256; c++) {
+                    if (classes[i].test(c)) {
+                        set[c >> 6] |= 1ULL << (c & 63);
+                    }
+                }
+                p = end + 2;
+                continue;
+            }
+        }
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        }
+        unsigned char low = (unsigned char)*p++;
+        unsigned char high = low;
+        if (p[0] == '-' && p[1] != ']' && p[1] != '\0') {
+            p += 1 + (p[1] == '\\' && p[2] != '\0');
+            high = (unsigned char)*p++;
+        }
+        for (int c = low; c <= high; c++) {
+            set[c >> 6] |= 1ULL << (c & 63);
+        }
+    }
+    if (*p != ']') {
+        return NULL;
+    }
+    if (negate) {
+        for (int i = 0; i < 4; i++) {
+            set[i] = ~set[i];
+        }
+    }
+    return p + 1;
+}
+
+// Compile one component of a pattern (no '/' in it)
+void compile_glob_component(const char *text, glob_component *comp) {
+    size_t len = strlen(text);
+    comp->steps = arena_alloc(&command_arena, (len + 1) * sizeof(glob_step));
+    comp->count = 0;
+    comp->globstar = strcmp(text, "**") == 0;
+    comp->dot = text[0] == '.' || (text[0] == '\\' && text[1] == '.');
+    char *name = arena_alloc(&command_arena, len + 1);
+    size_t name_len = 0;
+    int wild = 0;
+    const char *p = text;
+    while (*p != '\0') {
+        glob_step *step = &comp->steps[comp->count];
+        const char *end;
+        if (*p == '*') {
+            wild = 1;
+            p++;
+            if (comp->count > 0 && comp->steps[comp->count - 1].op == GLOB_STAR) {
+                continue; // ** within a name is just *
+            }
+            step->op = GLOB_STAR;
+        } else if (*p == '?') {
+            wild = 1;
+            p++;
+            step->op = GLOB_ANY;
+        } else if (*p == '[' && (end = compile_glob_set(p + 1, step->set = arena_alloc(&command_arena, 4 * sizeof(uint64_t)))) != NULL) {
+            wild = 1;
+            p = end;
+            step->op = GLOB_SET;
+        } else {
+            if (*p == '\\' && p[1] != '\0') {
+                p++;
+            }
+            step->op = GLOB_CHAR;
+            step->c = (unsigned char)*p++;
+            name[name_len++] = (char)step->c;
+        }
+        comp->count++;
+    }
+    name[name_len] = '\0';
+    comp->name = wild ? NULL : name;
+}
+
+// Whether a name matches a compiled component. A '*' takes as little as it can
+// and gives more back only on a mismatch, so no match takes more than
+// name length times step count character tests.
+int glob_match(const glob_component *comp, const char *name) {
+    if (name[0] == '.' && !comp->dot) {
+        return 0;
+    }
+    const glob_step *steps = comp->steps;
+    int s = 0;
+    int star = -1;                // Step after the last '*' seen
+    const char *star_name = NULL; // Where that '*' stopped taking characters
+    while (*name != '\0') {
+        unsigned char c = (unsigned char)*name;
+        if (s < comp->count && steps[s].op == GLOB_STAR) {
+            star = ++s;
+            star_name = name;
+        } else if (s < comp->count && (steps[s].op == GLOB_ANY || (steps[s].op == GLOB_CHAR && steps[s].c == c) ||
+                                       (steps[s].op == GLOB_SET && (steps[s].set[c >> 6] >> (c & 63)) & 1))) {
+            s++;
+            name++;
+        } else if (star >= 0) {
+            s = star;
+            name = ++star_name;
+        } else {
+            return 0;
+        }
+    }
+    while (s < comp->count && steps[s].op == GLOB_STAR) {
+        s++;
+    }
+    return s == comp->count;
+}
+
+// Read a directory's entries, once: getdents64 batches go into the command arena
+// and the entries point into them
+void list_glob_dir(glob_dir *dir) {
+    if (dir->listed) {
+        return;
+    }
+    dir->listed = 1;
+    char *buffer = malloc(LS_BUFFER_SIZE);
+    if (buffer == NULL) {
+        return;
+    }
+    size_t cap = 0;
+    ssize_t n;
+    while ((n = getdents64(dir->fd, buffer, LS_BUFFER_SIZE)) > 0) {
+        char *batch = arena_alloc(&command_arena, n);
+        memcpy(batch, buffer, n);
+        for (ssize_t offset = 0; offset < n;) {
+            struct dirent64 *d = (struct dirent64 *)(batch + offset);
+            offset += d->d_reclen;
+            if (d->d_name[0] == '.' && (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0'))) {
+                continue;
+            }
+            if (dir->count == cap) {
+                cap = cap > 0 ? cap * 2 : 256;
+                struct dirent64 **grown = realloc(dir->entries, cap * sizeof(struct dirent64 *));
+                if (grown == NULL) {
+                    free(buffer);
+                    return;
+                }
+                dir->entries = grown;
+            }
+            dir->entries[dir->count++] = d;
+        }
+    }
+    free(buffer);
+}
+
+// prefix + name + tail, in the arena
+char *join_glob_path(glob_dir *dir, const char *name, const char *tail) {
+    size_t name_len = strlen(name);
+    size_t tail_len = strlen(tail);
+    char *path = arena_alloc(&command_arena, dir->prefix_len + name_len + tail_len + 1);
+    memcpy(path, dir->prefix, dir->prefix_len);
+    memcpy(path + dir->prefix_len, name, name_len);
+    memcpy(path + dir->prefix_len + name_len, tail, tail_len + 1);
+    return path;
+}
+
+// Whether an entry is a directory; symlinks count only when follow is set
+int glob_entry_is_dir(glob_dir *dir, struct dirent64 *d, int follow) {
+    if (d->d_type == DT_DIR) {
+        return 1;
+    }
+    if (d->d_type != DT_UNKNOWN && !(follow && d->d_type == DT_LNK)) {
+        return 0;
+    }
+    struct stat st;
+    return fstatat(dir->fd, d->d_name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+void glob_walk(glob_dir *dir, glob_component *comps, int i, int n, glob_results *out);
+
+// Walk into the subdirectory name of dir with components from i on
+void glob_descend(glob_dir *dir, const char *name, glob_component *comps, int i, int n, int reached, glob_results *out) {
+    glob_dir sub = { openat(dir->fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC), NULL, 0, NULL, 0, 0, reached };
+    if (sub.fd == -1) {
+        return;
+    }
+    sub.prefix = join_glob_path(dir, name, "/");
+    sub.prefix_len = dir->prefix_len + strlen(name) + 1;
+    glob_walk(&sub, comps, i, n, out);
+    close(sub.fd);
+    free(sub.entries);
+}
+
+// Match components i..n-1 below dir, adding the paths that match all of them
+void glob_walk(glob_dir *dir, glob_component *comps, int i, int n, glob_results *out) {
+    if (i < n - 1 && comps[i].count == 0) {
+        // An empty component, from "//": the paths keep the extra '/', as in bash
+        glob_dir same = *dir;
+        same.prefix = join_glob_path(dir, "", "/");
+        same.prefix_len++;
+        glob_walk(&same, comps, i + 1, n, out);
+        if (same.entries != dir->entries) {
+            free(same.entries);
+        }
+        return;
+    }
+    glob_component *comp = &comps[i];
+    int last = i == n - 1;
+    if (comp->name != NULL) {
+        // No wildcards: look the name up instead of reading the directory
+        struct stat st;
+        if (last && comp->name[0] == '\0') {
+            if (dir->prefix_len > 0) {
+                add_glob_result(out, dir->prefix); // A trailing '/': the directory itself
+            }
+        } else if (last) {
+            if (fstatat(dir->fd, comp->name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                add_glob_result(out, join_glob_path(dir, comp->name, ""));
+            }
+        } else {
+            glob_descend(dir, comp->name, comps, i + 1, n, GLOB_BY_NAME, out);
+        }
+        return;
+    }
+
+    list_glob_dir(dir);
+    // "**" matching zero directories: a final one stands for the directory itself
+    // (bash shows it as "dir/" when it was named, "dir" when a pattern matched it),
+    // else the rest goes on from here
+    if (comp->globstar && last && dir->prefix_len > 0 && dir->reached != GLOB_BY_GLOBSTAR) {
+        char *self = dir->prefix;
+        if (dir->reached == GLOB_BY_PATTERN) {
+            self = join_glob_path(dir, "", "");
+            self[dir->prefix_len - 1] = '\0';
+        }
+        add_glob_result(out, self);
+    } else if (comp->globstar && !last) {
+        glob_walk(dir, comps, i + 1, n, out);
+    }
+    int dirs_only = comp->globstar && i + 1 == n - 1 && comps[i + 1].name != NULL && comps[i + 1].name[0] == '\0';
+    for (size_t e = 0; e < dir->count; e++) {
+        struct dirent64 *d = dir->entries[e];
+        if (comp->globstar) {
+            if (d->d_name[0] == '.') {
+                continue;
+            }
+            if (last) {
+                add_glob_result(out, join_glob_path(dir, d->d_name, ""));
+            }
+            if (glob_entry_is_dir(dir, d, 0)) {
+                glob_descend(dir, d->d_name, comps, i, n, GLOB_BY_GLOBSTAR, out);
+            } else if (dirs_only && d->d_type != DT_REG && glob_entry_is_dir(dir, d, 1)) {
+                add_glob_result(out, join_glob_path(dir, d->d_name, "/")); // "**/" lists a link to a directory, without going in
+            }
+        } else if (glob_match(comp, d->d_name)) {
+            if (last) {
+                add_glob_result(out, join_glob_path(dir, d->d_name, ""));
+            } else if (glob_entry_is_dir(dir, d, 1)) {
+                glob_descend(dir, d->d_name, comps, i + 1, n, GLOB_BY_PATTERN, out);
+            }
+        }
+    }
+}
+
+// Sort strings in byte order by multikey quicksort (Bentley and Sedgewick): a
+// radix sort on the character at depth, with three-way partitioning around a
+// pivot character, so a prefix the strings share is only looked at once. The
+// two smaller partitions recurse and the largest loops, bounding the stack.
+void sort_strings(char **a, size_t n, size_t depth) {
+    while (n > 1) {
+        if (n < 16) {
+            for (size_t i = 1; i < n; i++) {
+                char *s = a[i];
+                size_t j = i;
+                while (j > 0 && strcmp(a[j - 1] + depth, s + depth) > 0) {
+                    a[j] = a[j - 1];
+                    j--;
+                }
+                a[j] = s;
+            }
+            return;
+        }
+        unsigned char x = (unsigned char)a[0][depth];
+        unsigned char y = (unsigned char)a[n / 2][depth];
+        unsigned char z = (unsigned char)a[n - 1][depth];
+        unsigned char pivot = x < y ? (y < z ? y : (x < z ? z : x)) : (x < z ? x : (y < z ? z : y));
+        size_t lt = 0, i = 0, gt = n;
+        while (i < gt) {
+            unsigned char c = (unsigned char)a[i][depth];
+            char *swap;
+            if (c < pivot) {
+                swap = a[lt], a[lt++] = a[i], a[i++] = swap;
+            } else if (c > pivot) {
+                swap = a[--gt], a[gt] = a[i], a[i] = swap;
+            } else {
+                i++;
+            }
+        }
+        // Below the pivot [0, lt), equal [lt, gt) (sorted on from depth + 1), above [gt, n)
+        size_t eq = pivot != 0 ? gt - lt : 0; // Equal strings that have all ended are done
+        size_t above = n - gt;
+        if (lt >= eq && lt >= above) {
+            sort_strings(a + lt, eq, depth + 1);
+            sort_strings(a + gt, above, depth);
+            n = lt;
+        } else if (eq >= above) {
+            sort_strings(a, lt, depth);
+            sort_strings(a + gt, above, depth);
+            a += lt;
+            n = eq;
+            depth++;
+        } else {
+            sort_strings(a, lt, depth);
+            sort_strings(a + lt, eq, depth + 1);
+            a += gt;
+            n = above;
+        }
+    }
+}
+
+// Add the paths a pattern matches to out, sorted; adds nothing when it has no
+// wildcards once quoting is accounted for, or matches nothing
+void expand_glob(const char *pattern, glob_results *out) {
+    size_t len = strlen(pattern);
+    char *copy = arena_alloc(&command_arena, len + 1);
+    memcpy(copy, pattern, len + 1);
+    int n = 1;
+    for (size_t i = 0; i < len; i++) {
+        n += copy[i] == '/';
+    }
+    glob_component *comps = arena_alloc(&command_arena, n * sizeof(glob_component));
+    int wild = 0;
+    char *text = copy;
+    int kept = 0;
+    for (int i = 0; i < n; i++) {
+        char *slash = strchr(text, '/');
+        if (slash != NULL) {
+            *slash = '\0';
+        }
+        compile_glob_component(text, &comps[kept]);
+        wild |= comps[kept].name == NULL;
+        if (!(comps[kept].globstar && kept > 0 && comps[kept - 1].globstar)) {
+            kept++; // "**/**" is one "**"
+        }
+        text = slash != NULL ? slash + 1 : text;
+    }
+    n = kept;
+    if (!wild) {
+        return;
+    }
+
+    int absolute = pattern[0] == '/';
+    glob_dir top = { open(absolute ? "/" : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC), absolute ? "/" : "",
+                     (size_t)absolute, NULL, 0, 0, GLOB_BY_NAME };
+    if (top.fd == -1) {
+        return;
+    }
+    size_t start = out->count;
+    glob_walk(&top, comps, absolute, n, out);
+    close(top.fd);
+    free(top.entries);
+    sort_strings(out->items + start, out->count - start, 0);
+}
+
+// FNV-1a hash of a string
+unsigned int hash_string(const char *str) {
+    unsigned int hash = 2166136261u;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Forget every cached command path
+void clear_command_hash() {
+    for (int i = 0; i < COMMAND_HASH_SIZE; i++) {
+        command_hash_entry *entry = command_hash[i];
+        while (entry != NULL) {
+            command_hash_entry *next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        command_hash[i] = NULL;
+    }
+}
+
+// Drop one command from the cache, e.g. after its binary disappeared
+void forget_command(const char *name) {
+    command_hash_entry **link = &command_hash[hash_string(name) % COMMAND_HASH_SIZE];
+    while (*link != NULL) {
+        if (strcmp((*link)->name, name) == 0) {
+            command_hash_entry *entry = *link;
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+// Search PATH for an executable called name; returns a malloc'd path or NULL
+char *search_path(const char *name) {
+    const char *path_env = getenv("PATH");
+    if (path_env == NULL) {
+        path_env = "/usr/local/bin:/usr/bin:/bin";
+    }
+
+    size_t name_len = strlen(name);
+    const char *dir = path_env;
+    while (1) {
+        const char *end = strchr(dir, ':');
+        size_t dir_len = end ? (size_t)(end - dir) : strlen(dir);
+
+        char *candidate = malloc(dir_len + name_len + 3);
+        if (candidate == NULL) {
+            return NULL;
+        }
+        if (dir_len == 0) {
+            strcpy(candidate, "."); // An empty PATH entry means the current directory
+            dir_len = 1;
+        } else {
+            memcpy(candidate, dir, dir_len);
+        }
+        candidate[dir_len] = '/';
+        memcpy(candidate + dir_len + 1, name, name_len + 1);
+
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+        free(candidate);
+
+        if (end == NULL) {
+            return NULL;
+        }
+        dir = end + 1;
+    }
+}
+
+// Resolve a command name to the path to execute, using the cache.
+// Names containing '/' are used as they are. Returns NULL if not found.
+const char *resolve_command(const char *name) {
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+
+    // Any change to PATH makes every cached lookup suspect
+    const char *path_env = getenv("PATH");
+    if (path_env == NULL) {
+        path_env = "";
+    }
+    if (command_hash_path == NULL || strcmp(command_hash_path, path_env) != 0) {
+        clear_command_hash();
+        free(command_hash_path);
+        command_hash_path = strdup(path_env);
+    }
+
+    unsigned int bucket = hash_string(name) % COMMAND_HASH_SIZE;
+    for (command_hash_entry *entry = command_hash[bucket]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            entry->hits++;
+            return entry->path;
+        }
+    }
+
+    char *path = search_path(name);
+    if (path == NULL) {
+        return NULL;
+    }
+    command_hash_entry *entry = malloc(sizeof(command_hash_entry));
+    if (entry == NULL || (entry->name = strdup(name)) == NULL) {
+        free(entry);
+        free(path);
+        return NULL;
+    }
+    entry->path = path;
+    entry->hits = 1;
+    entry->next = command_hash[bucket];
+    command_hash[bucket] = entry;
+    return path;
+}
+
+// Print the cached commands the way 'hash' does
+void print_command_hash() {
+    int printed = 0;
+    for (int i = 0; i < COMMAND_HASH_SIZE; i++) {
+        for (command_hash_entry *entry = command_hash[i]; entry != NULL; entry = entry->next) {
+            if (!printed) {
+                out_printf("hits\tcommand\n");
+                printed = 1;
+            }
+            out_printf("%4d\t%s\n", entry->hits, entry->path);
+        }
+    }
+    if (!printed) {
+        out_printf("hash: hash table empty\n");
+    }
+}
+
+// Whether the first len characters of name make a variable name
+int valid_variable_name(const char *name, size_t len) {
+    if (len == 0 || !(isalpha((unsigned char)name[0]) || name[0] == '_')) {
+        return 0;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if (!(isalnum((unsigned char)name[i]) || name[i] == '_')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// The variable called by the first len characters of name, or NULL
+variable *find_variable(const char *name, size_t len) {
+    unsigned int hash = 2166136261u; // hash_string over just the name
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    for (variable *v = variables[hash % VARIABLE_HASH_SIZE]; v != NULL; v = v->next) {
+        if (strncmp(v->name, name, len) == 0 && v->name[len] == '\0') {
+            return v;
+        }
+    }
+    return NULL;
+}
+
+// Value of a shell variable, or NULL if it is unset
+const char *get_variable(const char *name) {
+    variable *v = find_variable(name, strlen(name));
+    return v != NULL ? v->value : NULL;
+}
+
+// Set a variable, exporting it if export is set (an exported one stays so).
+// Returns 0, or -1 when out of memory.
+int set_variable(const char *name, const char *value, int export) {
+    variable *v = find_variable(name, strlen(name));
+    char *copy = strdup(value);
+    if (copy == NULL) {
+        return -1;
+    }
+    if (v == NULL) {
+        v = malloc(sizeof(variable));
+        if (v == NULL || (v->name = strdup(name)) == NULL) {
+            free(v);
+            free(copy);
+            return -1;
+        }
+        unsigned int bucket = hash_string(name) % VARIABLE_HASH_SIZE;
+        v->exported = 0;
+        v->value = NULL;
+        v->next = variables[bucket];
+        variables[bucket] = v;
+    }
+    free(v->value);
+    v->value = copy;
+    v->exported |= export;
+    if (v->exported) {
+        setenv(name, copy, 1); // value may have been the old copy, now freed
+    }
+    return 0;
+}
+
+// Remove a variable, from the environment too
+void unset_variable(const char *name) {
+    variable **link = &variables[hash_string(name) % VARIABLE_HASH_SIZE];
+    while (*link != NULL) {
+        variable *v = *link;
+        if (strcmp(v->name, name) == 0) {
+            *link = v->next;
+            if (v->exported) {
+                unsetenv(name);
+            }
+            free(v->name);
+            free(v->value);
+            free(v);
+            return;
+        }
+        link = &v->next;
+    }
+}
+
+// Start the table with the environment the shell was given, all of it exported
+void import_environment() {
+    for (char **env = environ; *env != NULL; env++) {
+        char *eq = strchr(*env, '=');
+        if (eq != NULL && valid_variable_name(*env, eq - *env)) {
+            char *name = strndup(*env, eq - *env);
+            if (name != NULL) {
+                set_variable(name, eq + 1, 1);
+                free(name);
+            }
+        }
+    }
+}
+
+void free_variables() {
+    for (int i = 0; i < VARIABLE_HASH_SIZE; i++) {
+        while (variables[i] != NULL) {
+            variable *v = variables[i];
+            variables[i] = v->next;
+            free(v->name);
+            free(v->value);
+            free(v);
+        }
+    }
+}
+
+int compare_variables(const void *a, const void *b) {
+    return strcmp((*(variable *const *)a)->name, (*(variable *const *)b)->name);
+}
+
+// Handle 'export name[=value]...': set the variables given a value, and pass them
+// all on to launched commands. Alone or with -p, list the exported variables.
+int export_command(char **args) {
+    int first = args[1] != NULL && strcmp(args[1], "-p") == 0 ? 2 : 1;
+    if (args[first] == NULL) {
+        size_t count = 0;
+        for (int i = 0; i < VARIABLE_HASH_SIZE; i++) {
+            for (variable *v = variables[i]; v != NULL; v = v->next) {
+                count += v->exported;
+            }
+        }
+        variable **sorted = malloc((count + 1) * sizeof(variable *));
+        if (sorted == NULL) {
+            out_printf("Invalid Command\n");
+            return 1;
+        }
+        count = 0;
+        for (int i = 0; i < VARIABLE_HASH_SIZE; i++) {
+            for (variable *v = variables[i]; v != NULL; v = v->next) {
+                if (v->exported) {
+                    sorted[count++] = v;
+                }
+            }
+        }
+        qsort(sorted, count, sizeof(variable *), compare_variables);
+        for (size_t i = 0; i < count; i++) {
+            out_printf("export %s=\"", sorted[i]->name);
+            for (const char *c = sorted[i]->value; *c != '\0'; c++) {
+                if (strchr("\"\\$`", *c) != NULL) {
+                    out_putc('\\');
+                }
+                out_putc(*c);
+            }
+            out_printf("\"\n");
+        }
+        free(sorted);
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = first; args[i] != NULL; i++) {
+        char *eq = strchr(args[i], '=');
+        size_t len = eq != NULL ? (size_t)(eq - args[i]) : strlen(args[i]);
+        if (!valid_variable_name(args[i], len)) {
+            out_printf("Invalid Command\n");
+            status = 1;
+            continue;
+        }
+        if (eq != NULL) {
+            *eq = '\0'; // The argument is ours to cut up
+            if (set_variable(args[i], eq + 1, 1) != 0) {
+                out_printf("Invalid Command\n");
+                status = 1;
+            }
+            *eq = '=';
+        } else {
+            variable *v = find_variable(args[i], len);
+            if (v != NULL && !v->exported) {
+                set_variable(args[i], v->value, 1);
+            }
+        }
+    }
+    return status;
+}
+
+// Handle 'unset [-v] name...': remove shell variables
+int unset_command(char **args) {
+    int status = 0;
+    int first = args[1] != NULL && strcmp(args[1], "-v") == 0 ? 2 : 1;
+    for (int i = first; args[i] != NULL; i++) {
+        if (!valid_variable_name(args[i], strlen(args[i]))) {
+            out_printf("Invalid Command\n");
+            status = 1;
+            continue;
+        }
+        unset_variable(args[i]);
+    }
+    return status;
+}
+
+// Handle 'exit [N]': leave the shell once the current command line stops, with
+// status N, or the last command's status when there is none
+int exit_command(char **args) {
+    if (args[1] != NULL && args[2] != NULL) {
+        out_printf("Invalid Command\n");
+        return 1; // Like other shells, too many arguments don't exit
+    }
+    int status = last_status;
+    if (args[1] != NULL) {
+        char *end;
+        long value = strtol(args[1], &end, 10);
+        if (*end != '\0' || end == args[1]) {
+            out_printf("Invalid Command\n");
+            value = 2;
+        }
+        status = (int)(value & 0xff);
+    }
+    exit_requested = 1;
+    return status;
+}
+
+// Handle 'cd [dir | ~ | -]', remembering the directory left for 'cd -'
+int cd_command(char **args) {
+    int status = 0;
+    char current_dir[INITIAL_CMD_SIZE];
+    if (getcwd(current_dir, sizeof(current_dir)) == NULL) {
+        out_printf("Invalid Command\n");
+        status = 1;
+    } else if (args[1] == NULL || strcmp(args[1], "~") == 0) {
+        const char *home_dir = get_variable("HOME");
+        if (home_dir) {
+            if (chdir(home_dir) != 0) {
+                out_printf("Invalid Command\n");
+                status = 1;
+            } else {
+                strncpy(prev_dir, current_dir, sizeof(prev_dir)); // Update previous directory
+            }
+        } else {
+            out_printf("Invalid Command\n");
+            status = 1;
+        }
+    } else if (strcmp(args[1], "-") == 0) {
+        if (strlen(prev_dir) == 0) {
+            // Do nothing if OLDPWD is not set
+        } else {
+            if (chdir(prev_dir) == 0) {
+                // On success, print the previous directory
+                out_printf("%s\n", prev_dir);
+                strncpy(prev_dir, current_dir, sizeof(prev_dir)); // Update previous directory
+            } else {
+                out_printf("Invalid Command\n");
+                status = 1;
+            }
+        }
+    } else {
+        if (chdir(args[1]) != 0) {
+            out_printf("Invalid Command\n");
+            status = 1;
+        } else {
+            strncpy(prev_dir, current_dir, sizeof(prev_dir)); // Update previous directory
+        }
+    }
+    return status;
+}
+
+// Handle 'hash': list, clear (-r) or add entries to the command path cache
+int hash_command(char **args) {
+    int status = 0;
+    if (args[1] == NULL) {
+        print_command_hash();
+    } else if (strcmp(args[1], "-r") == 0) {
+        clear_command_hash();
+    } else {
+        for (int i = 1; args[i] != NULL; i++) {
+            if (strchr(args[i], '/') == NULL && resolve_command(args[i]) == NULL) {
+                out_printf("Invalid Command\n");
+                status = 1;
+            }
+        }
+    }
+    return status;
+}
+
+// Open the files behind a command's redirections and turn them into fd actions.
+// The first reserve actions are left for the caller to fill in; they run before
+// the redirections, so what the user wrote wins. Returns 0, or -1 (after
+// reporting it) when a file can't be opened.
+int prepare_redirects(command_node *node, int reserve, fd_action **actions_out, int *count_out) {
+    fd_action *actions = arena_alloc(&command_arena, (reserve + node->redirect_count) * sizeof(fd_action));
+    for (int i = 0; i < reserve; i++) {
+        actions[i].fd = -1;
+        actions[i].source = -1;
+        actions[i].owned = 0;
+    }
+    int count = reserve;
+    for (int i = 0; i < node->redirect_count; i++) {
+        redirect *r = &node->redirects[i];
+        fd_action *action = &actions[count];
+        action->fd = r->fd;
+        action->owned = 1;
+        switch (r->type) {
+        case TOKEN_LESS:
+            action->source = open(r->target, O_RDONLY | O_CLOEXEC);
+            break;
+        case TOKEN_GREAT:
+            action->source = open(r->target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            break;
+        case TOKEN_DGREAT:
+            action->source = open(r->target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+            break;
+        case TOKEN_TLESS: {
+            // The here-string plus a newline, served from an anonymous file
+            action->source = memfd_create("here-string", MFD_CLOEXEC);
+            if (action->source != -1) {
+                if (write_all(action->source, r->target, strlen(r->target)) != 0 || write_all(action->source, "\n", 1) != 0
+                        || lseek(action->source, 0, SEEK_SET) != 0) {
+                    close(action->source);
+                    action->source = -1;
+                }
+            }
+            break;
+        }
+        default: {
+            // <& and >& take a descriptor number, or - to close
+            action->owned = 0;
+            char *end;
+            long source = strtol(r->target, &end, 10);
+            if (strcmp(r->target, "-") == 0) {
+                action->source = -1;
+                count++;
+                continue;
+            }
+            if (*end != '\0' || end == r->target || source < 0 || fcntl((int)source, F_GETFD) == -1) {
+                action->source = -1;
+                errno = EBADF;
+            } else {
+                action->source = (int)source;
+            }
+            break;
+        }
+        }
+
+        if (action->source == -1) {
+            out_printf("Invalid Command\n");
+            *count_out = count;
+            *actions_out = actions;
+            return -1;
+        }
+        count++;
+    }
+    *actions_out = actions;
+    *count_out = count;
+    return 0;
+}
+
+// Close the files prepare_redirects opened, once the child has its copies
+void close_redirects(fd_action *actions, int count) {
+    for (int i = 0; i < count; i++) {
+        if (actions[i].owned && actions[i].source != -1) {
+            close(actions[i].source);
+        }
+    }
+}
+
+// Carry out fd actions in the current process
+void apply_fd_actions(fd_action *actions, int count) {
+    for (int i = 0; i < count; i++) {
+        if (actions[i].source == -1) {
+            close(actions[i].fd);
+        } else if (actions[i].source == actions[i].fd) {
+            fcntl(actions[i].fd, F_SETFD, 0); // Keep it across exec
+        } else {
+            dup2(actions[i].source, actions[i].fd);
+        }
+    }
+}
+
+// Apply a builtin's fd actions to the shell itself; returns copies of the
+// descriptors they replace (-1 where one was closed) for restore_shell_fds
+int *redirect_shell_fds(fd_action *actions, int count) {
+    int *saved = arena_alloc(&command_arena, (count > 0 ? count : 1) * sizeof(int));
+    flush_output(); // Pending output belongs to the old stdout
+    for (int i = 0; i < count; i++) {
+        saved[i] = fcntl(actions[i].fd, F_DUPFD_CLOEXEC, 10);
+        apply_fd_actions(&actions[i], 1);
+    }
+    return saved;
+}
+
+// Undo redirect_shell_fds, newest action first
+void restore_shell_fds(fd_action *actions, int count, int *saved) {
+    flush_output();
+    for (int i = count - 1; i >= 0; i--) {
+        if (saved[i] != -1) {
+            dup2(saved[i], actions[i].fd);
+            close(saved[i]);
+        } else {
+            close(actions[i].fd);
+        }
+    }
+}
+
+// Trace of shell activity in Chrome's trace-event JSON, which chrome://tracing
+// and Perfetto open: complete ("X") events for parsing, PATH lookups, spawns,
+// waits and builtins on the shell's track, and one span per child on its own.
+// Events collect in a buffer written out in large batches; with tracing off
+// every hook is a single test of trace_fd.
+int trace_fd = -1;          // Trace file, or -1 when tracing is off
+char *trace_buffer = NULL;  // Events not yet written
+size_t trace_used = 0;      // Bytes in trace_buffer
+int trace_events = 0;       // Events written so far, for the separators
+pid_t trace_pid = 0;        // The shell's pid, the track of its own spans
+
+// Microseconds on the monotonic clock, or 0 when tracing is off
+double trace_now() {
+    if (trace_fd == -1) {
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+void flush_trace() {
+    if (trace_fd != -1 && trace_used > 0) {
+        write_all(trace_fd, trace_buffer, trace_used);
+        trace_used = 0;
+    }
+}
+
+void append_trace(const char *text, size_t len) {
+    if (trace_used + len > TRACE_BUFFER_SIZE) {
+        flush_trace();
+    }
+    if (len > TRACE_BUFFER_SIZE) {
+        write_all(trace_fd, text, len);
+        return;
+    }
+    memcpy(trace_buffer + trace_used, text, len);
+    trace_used += len;
+}
+
+// Copy text into out as the inside of a JSON string, cut short to fit
+void trace_escape(char *out, size_t size, const char *text) {
+    size_t used = 0;
+    for (; *text != '\0' && used + 7 < size; text++) {
+        unsigned char c = *text;
+        if (c == '"' || c == '\\') {
+            out[used++] = '\\';
+            out[used++] = c;
+        } else if (c < 0x20) {
+            used += snprintf(out + used, size - used, "\\u%04x", c);
+        } else {
+            out[used++] = c;
+        }
+    }
+    out[used] = '\0';
+}
+
+// Add one event; fields are the JSON members after the separator, already formatted
+void trace_event(const char *fields) {
+    if (trace_events++ > 0) {
+        append_trace(",\n", 2);
+    }
+    append_trace(fields, strlen(fields));
+}
+
+// Add a span from start to now on pid's track. args are JSON members for the
+// event's args (or ""); name is escaped here. A span that began before tracing
+// did (start 0) is left out.
+void trace_span(const char *category, const char *name, double start, pid_t pid, const char *args) {
+    if (trace_fd == -1 || start == 0) {
+        return;
+    }
+    char escaped[256];
+    trace_escape(escaped, sizeof(escaped), name);
+    char fields[1024];
+    snprintf(fields, sizeof(fields),
+             "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{%s}}",
+             escaped, category, start, trace_now() - start, (int)pid, (int)pid, args);
+    trace_event(fields);
+}
+
+// Name a process's track in the trace viewer
+void trace_process_name(pid_t pid, const char *name) {
+    char escaped[256];
+    trace_escape(escaped, sizeof(escaped), name);
+    char fields[512];
+    snprintf(fields, sizeof(fields), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+             (int)pid, escaped);
+    trace_event(fields);
+}
+
+// Start writing a trace to path; returns 0, or -1 if it can't be opened
+int start_trace(const char *path) {
+    if (trace_fd != -1) {
+        return 0;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    trace_buffer = malloc(TRACE_BUFFER_SIZE);
+    if (trace_buffer == NULL) {
+        close(fd);
+        return -1;
+    }
+    trace_fd = fd;
+    trace_used = 0;
+    trace_events = 0;
+    trace_pid = getpid();
+    append_trace("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", 40);
+    trace_process_name(trace_pid, "shell");
+    return 0;
+}
+
+// Finish the trace file and stop tracing
+void stop_trace() {
+    if (trace_fd == -1) {
+        return;
+    }
+    append_trace("\n]}\n", 4);
+    flush_trace();
+    close(trace_fd);
+    free(trace_buffer);
+    trace_buffer = NULL;
+    trace_fd = -1;
+}
+
+// In a forked child: drop the parent's trace without writing it twice
+void forget_trace() {
+    if (trace_fd != -1) {
+        close(trace_fd);
+        free(trace_buffer);
+        trace_buffer = NULL;
+        trace_fd = -1;
+    }
+}
+
+// Cost of one foreground pipeline, collected while 'time' or 'stats on' wants
+// it: what wait4 reports for each forked stage, the shell's own usage while it
+// runs a stage itself, and the time the shell spent parsing and starting it
+typedef struct {
+    int stage;             // Stage being started
+    int stage_count;       // Stages in the pipeline
+    pid_t *pids;           // Process of each stage, 0 for one run in the shell
+    struct rusage *usage;  // Resource use of each stage
+    double parse_seconds;  // Tokenizing and parsing the command line
+    double spawn_seconds;  // Forking and spawning the stages
+} pipeline_metrics;
+
+pipeline_metrics *active_metrics = NULL; // Where the running pipeline records its cost, or NULL
+double line_parse_seconds = 0;           // Parse time of the command line not yet charged to a pipeline
+int stats_enabled = 0;                   // 'stats on': measure every foreground pipeline
+
+// Seconds from one monotonic clock reading to another
+double elapsed_seconds(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+double timeval_seconds(struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// Add one rusage to another: times and counters add up, max RSS takes the larger
+void add_rusage(struct rusage *total, struct rusage *more) {
+    timeradd(&total->ru_utime, &more->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &more->ru_stime, &total->ru_stime);
+    total->ru_maxrss = more->ru_maxrss > total->ru_maxrss ? more->ru_maxrss : total->ru_maxrss;
+    total->ru_majflt += more->ru_majflt;
+    total->ru_minflt += more->ru_minflt;
+    total->ru_nvcsw += more->ru_nvcsw;
+    total->ru_nivcsw += more->ru_nivcsw;
+}
+
+// Charge the shell's usage since before to the stage being run, which the shell runs itself
+void charge_shell_usage(struct rusage *before) {
+    struct rusage after;
+    getrusage(RUSAGE_SELF, &after);
+    struct rusage *usage = &active_metrics->usage[active_metrics->stage];
+    timersub(&after.ru_utime, &before->ru_utime, &after.ru_utime);
+    timersub(&after.ru_stime, &before->ru_stime, &after.ru_stime);
+    after.ru_majflt -= before->ru_majflt;
+    after.ru_minflt -= before->ru_minflt;
+    after.ru_nvcsw -= before->ru_nvcsw;
+    after.ru_nivcsw -= before->ru_nivcsw;
+    add_rusage(usage, &after); // Max RSS stays the shell's own peak
+}
+
+// Launch an external command without copying the shell's address space.
+// in_fd/out_fd become stdin/stdout unless they already are them, then the fd
+// actions run in order. Every other descriptor the shell opens is close-on-exec.
+// Under job control pgid is the process group to join (0 starts a new one);
+// -1 leaves the child in the shell's group. Returns the child's pid, or -1 if
+// the command could not be started.
+pid_t launch_command(char **args, int in_fd, int out_fd, fd_action *fds, int fd_count, pid_t pgid) {
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        return -1;
+    }
+    posix_spawnattr_t attr;
+    if (posix_spawnattr_init(&attr) != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+
+    if (in_fd != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    for (int i = 0; i < fd_count; i++) {
+        if (fds[i].source == -1) {
+            posix_spawn_file_actions_addclose(&actions, fds[i].fd);
+        } else {
+            posix_spawn_file_actions_adddup2(&actions, fds[i].source, fds[i].fd); // Same fd: clears close-on-exec
+        }
+    }
+    if (pgid != -1) {
+        // The child joins its job's group and takes back the stop signals the shell ignores
+        sigset_t stop_signals;
+        sigemptyset(&stop_signals);
+        sigaddset(&stop_signals, SIGTSTP);
+        sigaddset(&stop_signals, SIGTTIN);
+        sigaddset(&stop_signals, SIGTTOU);
+        posix_spawnattr_setsigdefault(&attr, &stop_signals);
+        posix_spawnattr_setpgroup(&attr, pgid);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF);
+    }
+
+    pid_t pid;
+    int err = ENOENT;
+    flush_output(); // The child shares nothing with our buffers, but keep output ordered
+    struct timespec started, spawned;
+    if (active_metrics != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &started);
+    }
+    double traced = trace_now();
+    const char *path = resolve_command(args[0]);
+    if (trace_fd != -1) {
+        char found[300];
+        trace_escape(found, sizeof(found), path != NULL ? path : "");
+        char trace_args[320];
+        snprintf(trace_args, sizeof(trace_args), "\"path\":\"%s\"", found);
+        trace_span("shell", "resolve", traced, trace_pid, trace_args);
+        traced = trace_now();
+    }
+    if (path != NULL) {
+        err = posix_spawn(&pid, path, &actions, &attr, args, environ);
+        if (err == ENOENT && path != args[0]) {
+            // The cached binary went away; look it up again once
+            forget_command(args[0]);
+            path = resolve_command(args[0]);
+            if (path != NULL) {
+                err = posix_spawn(&pid, path, &actions, &attr, args, environ);
+            }
+        }
+    }
+    if (active_metrics != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &spawned);
+        active_metrics->spawn_seconds += elapsed_seconds(&started, &spawned);
+    }
+    if (trace_fd != -1) {
+        char trace_args[128];
+        snprintf(trace_args, sizeof(trace_args), "\"pid\":%d,\"stdin\":%d,\"stdout\":%d,\"fd_actions\":%d,\"error\":%d",
+                 err == 0 ? (int)pid : -1, in_fd, out_fd, fd_count, err);
+        trace_span("shell", "spawn", traced, trace_pid, trace_args);
+        if (err == 0) {
+            trace_process_name(pid, args[0]);
+        }
+    }
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return err == 0 ? pid : -1;
+}
+
+// Shell exit status for a wait status: the exit code, or 128 + the signal number
+int exit_status(int wait_status) {
+    if (WIFEXITED(wait_status)) {
+        return WEXITSTATUS(wait_status);
+    }
+    if (WIFSIGNALED(wait_status)) {
+        return 128 + WTERMSIG(wait_status);
+    }
+    if (WIFSTOPPED(wait_status)) {
+        return 128 + WSTOPSIG(wait_status);
+    }
+    return 1;
+}
+
+// Processes of a pipeline running in the foreground, or of a job brought back to it
+typedef struct {
+    pid_t *pids; // Processes started and not yet reaped, in pipeline order
+    int count;   // Entries in pids
+    pid_t pgid;  // Their process group under job control, 0 until the first one starts
+    int stopped; // Set when they stopped instead of exiting; pids then holds the stopped ones
+    double *started; // Trace time each process started, when tracing the pipeline (else NULL)
+} pipeline_state;
+
+// Process group a new stage should join: -1 without job control
+pid_t stage_group(pipeline_state *ps) {
+    return shell_interactive ? ps->pgid : -1;
+}
+
+// Record a started stage. Under job control it goes into the pipeline's process
+// group (the child does the same, whichever runs first wins the race), and the
+// first stage's group is handed the terminal.
+void add_stage(pipeline_state *ps, pid_t pid) {
+    if (ps->started != NULL) {
+        ps->started[ps->count] = trace_now();
+    }
+    ps->pids[ps->count++] = pid;
+    if (active_metrics != NULL) {
+        active_metrics->pids[active_metrics->stage] = pid;
+    }
+    if (shell_interactive) {
+        if (ps->pgid == 0) {
+            ps->pgid = pid;
+        }
+        setpgid(pid, ps->pgid);
+        if (ps->pgid == pid) {
+            tcsetpgrp(STDIN_FILENO, pid);
+        }
+    }
+}
+
+// Give the terminal back to the shell after a foreground job
+void take_terminal() {
+    if (shell_interactive) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+    }
+}
+
+// Reap every stage of a pipeline together; returns the wait status of the last
+// stage. Under job control a stage may stop instead (Ctrl-Z): the stopped ones
+// are kept in ps for the job table and their stop status is returned.
+int wait_pipeline(pipeline_state *ps) {
+    int status = 0;
+    int stopped = 0;
+    flush_output(); // Whatever a builtin stage printed shouldn't wait on the others
+    for (int i = 0; i < ps->count; i++) {
+        int stage_status;
+        struct rusage usage;
+        pid_t reaped;
+        double traced = trace_now();
+        while ((reaped = wait4(ps->pids[i], &stage_status, shell_interactive ? WUNTRACED : 0,
+                               active_metrics != NULL ? &usage : NULL)) == -1) {
+            if (errno != EINTR) {
+                stage_status = 0;
+                break;
+            }
+        }
+        if (reaped > 0 && WIFSTOPPED(stage_status) && capturing_output > 0) {
+            // The shell is collecting its output for $( ), so it can't be left as a
+            // stopped job; let it carry on
+            kill(-ps->pgid, SIGCONT);
+            i--;
+            continue;
+        }
+        if (trace_fd != -1) {
+            // The shell's wait, and on the child's own track the span it ran for
+            char trace_args[64];
+            snprintf(trace_args, sizeof(trace_args), "\"pid\":%d,\"status\":%d", (int)ps->pids[i], exit_status(stage_status));
+            trace_span("shell", "wait", traced, trace_pid, trace_args);
+            if (ps->started != NULL) {
+                trace_span("process", WIFSTOPPED(stage_status) ? "stopped" : "exec", ps->started[i], ps->pids[i], trace_args);
+            }
+        }
+        if (reaped > 0 && active_metrics != NULL && !WIFSTOPPED(stage_status)) {
+            for (int k = 0; k < active_metrics->stage_count; k++) {
+                if (active_metrics->pids[k] == reaped) {
+                    add_rusage(&active_metrics->usage[k], &usage);
+                }
+            }
+        }
+        if (WIFSTOPPED(stage_status)) {
+            if (ps->started != NULL) {
+                ps->started[stopped] = ps->started[i];
+            }
+            ps->pids[stopped++] = ps->pids[i];
+            status = stage_status;
+        } else if (i == ps->count - 1 && stopped == 0) {
+            status = stage_status; // Pipeline status is that of the last stage, as in POSIX
+        }
+    }
+    ps->count = stopped;
+    ps->stopped = stopped > 0;
+    return status;
+}
+
+// Close the pipeline's read end, reap any stages still running unless they
+// stopped, and take the terminal back
+void finish_pipeline(int in_fd, pipeline_state *ps) {
+    if (in_fd != 0) {
+        close(in_fd);
+    }
+    if (!ps->stopped) {
+        wait_pipeline(ps);
+    }
+    take_terminal();
+}
+
+// SIGCHLD handler: only note the change, the job table is updated outside it
+void note_child_change(int sig) {
+    (void)sig;
+    children_changed = 1;
+}
+
+// Append text to the NUL-terminated string in buf, truncating at size
+void append_text(char *buf, size_t size, const char *text) {
+    size_t used = strlen(buf);
+    if (used + 1 < size) {
+        snprintf(buf + used, size - used, "%s", text);
+    }
+}
+
+// Spelling of a redirection operator, for job listings
+const char *redirect_operator(token_type type) {
+    switch (type) {
+    case TOKEN_LESS:
+        return "<";
+    case TOKEN_GREAT:
+        return ">";
+    case TOKEN_DGREAT:
+        return ">>";
+    case TOKEN_LESSAND:
+        return "<&";
+    case TOKEN_GREATAND:
+        return ">&";
+    default:
+        return "<<<";
+    }
+}
+
+// Append a readable rendering of a command tree to buf, for job listings
+void describe_node(command_node *node, char *buf, size_t size) {
+    if (node->timed) {
+        append_text(buf, size, node->timed == TIME_POSIX ? "time -p " : "time ");
+    }
+    switch (node->type) {
+    case NODE_COMMAND:
+        for (int i = 0; node->argv[i] != NULL; i++) {
+            if (i > 0) {
+                append_text(buf, size, " ");
+            }
+            append_text(buf, size, node->argv[i]);
+        }
+        break;
+    case NODE_PIPELINE:
+        for (int i = 0; i < node->stage_count; i++) {
+            if (i > 0) {
+                append_text(buf, size, " | ");
+            }
+            describe_node(node->stages[i], buf, size);
+        }
+        break;
+    case NODE_AND:
+    case NODE_OR:
+    case NODE_SEQUENCE:
+        describe_node(node->left, buf, size);
+        append_text(buf, size, node->type == NODE_AND ? " && " : node->type == NODE_OR ? " || " : "; ");
+        describe_node(node->right, buf, size);
+        break;
+    case NODE_SUBSHELL:
+        append_text(buf, size, "(");
+        describe_node(node->left, buf, size);
+        append_text(buf, size, ")");
+        break;
+    case NODE_BACKGROUND:
+        describe_node(node->left, buf, size);
+        append_text(buf, size, " &");
+        break;
+    }
+    for (int i = 0; i < node->redirect_count; i++) {
+        redirect *r = &node->redirects[i];
+        int input = r->type == TOKEN_LESS || r->type == TOKEN_LESSAND || r->type == TOKEN_TLESS;
+        char fd[16] = " ";
+        if (r->fd != (input ? STDIN_FILENO : STDOUT_FILENO)) {
+            snprintf(fd, sizeof(fd), " %d", r->fd);
+        }
+        append_text(buf, size, fd);
+        append_text(buf, size, redirect_operator(r->type));
+        append_text(buf, size, r->target);
+    }
+}
+
+// Add a job for the processes in pids (pipeline order) running the given stages;
+// returns it, or NULL if the table can't grow
+job *add_job(pid_t pgid, pid_t *pids, int pid_count, job_state state, command_node **stages, int stage_count) {
+    if (job_count == job_capacity) {
+        int capacity = job_capacity > 0 ? 2 * job_capacity : INITIAL_JOBS;
+        job *grown = realloc(jobs, capacity * sizeof(job));
+        if (grown == NULL) {
+            return NULL;
+        }
+        jobs = grown;
+        job_capacity = capacity;
+    }
+
+    char text[INITIAL_CMD_SIZE] = "";
+    for (int i = 0; i < stage_count; i++) {
+        if (i > 0) {
+            append_text(text, sizeof(text), " | ");
+        }
+        describe_node(stages[i], text, sizeof(text));
+    }
+    job *j = &jobs[job_count];
+    j->pids = malloc(pid_count * sizeof(pid_t));
+    j->command = strdup(text);
+    if (j->pids == NULL || j->command == NULL) {
+        free(j->pids);
+        free(j->command);
+        return NULL;
+    }
+    memcpy(j->pids, pids, pid_count * sizeof(pid_t));
+    j->id = job_count > 0 ? jobs[job_count - 1].id + 1 : 1; // One past the highest, like bash
+    j->pgid = pgid;
+    j->pid_count = pid_count;
+    j->last_pid = pids[pid_count - 1];
+    j->state = state;
+    j->status = 0;
+    j->touched = ++job_clock;
+    job_count++;
+    return j;
+}
+
+// Drop a job from the table
+void remove_job(job *j) {
+    free(j->pids);
+    free(j->command);
+    int index = j - jobs;
+    memmove(&jobs[index], &jobs[index + 1], (job_count - index - 1) * sizeof(job));
+    job_count--;
+}
+
+// The current (%+) and previous (%-) jobs: the two touched most recently
+void rank_jobs(job **current, job **previous) {
+    *current = NULL;
+    *previous = NULL;
+    for (int i = 0; i < job_count; i++) {
+        if (*current == NULL || jobs[i].touched > (*current)->touched) {
+            *previous = *current;
+            *current = &jobs[i];
+        } else if (*previous == NULL || jobs[i].touched > (*previous)->touched) {
+            *previous = &jobs[i];
+        }
+    }
+}
+
+// Look up a job by spec: %n, %+ or %% (also the default when spec is NULL), %-,
+// or the pid of one of its processes. Returns NULL if there is no such job.
+job *find_job(const char *spec) {
+    job *current;
+    job *previous;
+    rank_jobs(&current, &previous);
+    if (spec == NULL || strcmp(spec, "%") == 0 || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+        return current;
+    }
+    if (strcmp(spec, "%-") == 0) {
+        return previous;
+    }
+
+    const char *digits = spec[0] == '%' ? spec + 1 : spec;
+    char *end;
+    long number = strtol(digits, &end, 10);
+    if (*end != '\0' || end == digits) {
+        return NULL;
+    }
+    for (int i = 0; i < job_count; i++) {
+        if (spec[0] == '%') {
+            if (jobs[i].id == number) {
+                return &jobs[i];
+            }
+            continue;
+        }
+        if (jobs[i].pgid == number) {
+            return &jobs[i];
+        }
+        for (int k = 0; k < jobs[i].pid_count; k++) {
+            if (jobs[i].pids[k] == number) {
+                return &jobs[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+// Print a job the way 'jobs' does
+void print_job(job *j) {
+    job *current;
+    job *previous;
+    rank_jobs(&current, &previous);
+    char state[32];
+    if (j->state == JOB_RUNNING) {
+        strcpy(state, "Running");
+    } else if (j->state == JOB_STOPPED) {
+        strcpy(state, "Stopped");
+    } else if (j->status == 0) {
+        strcpy(state, "Done");
+    } else {
+        snprintf(state, sizeof(state), "Exit %d", j->status);
+    }
+    out_printf("[%d]%c  %-24s%s%s\n", j->id, j == current ? '+' : j == previous ? '-' : ' ', state, j->command,
+           j->state == JOB_RUNNING ? " &" : "");
+}
+
+// Collect every pending exit, stop and continue of the jobs' processes without blocking
+void reap_jobs() {
+    children_changed = 0;
+    for (int i = 0; i < job_count; i++) {
+        job *j = &jobs[i];
+        int k = 0;
+        while (k < j->pid_count) {
+            int wait_status;
+            pid_t pid = waitpid(j->pids[k], &wait_status, WNOHANG | WUNTRACED | WCONTINUED);
+            if (pid == 0 || (pid == -1 && errno == EINTR)) {
+                k++;
+            } else if (pid > 0 && WIFSTOPPED(wait_status)) {
+                if (j->state != JOB_STOPPED) {
+                    j->state = JOB_STOPPED;
+                    j->touched = ++job_clock;
+                }
+                k++;
+            } else if (pid > 0 && WIFCONTINUED(wait_status)) {
+                j->state = JOB_RUNNING;
+                k++;
+            } else {
+                // Exited, killed, or already reaped elsewhere
+                if (pid > 0 && j->pids[k] == j->last_pid) {
+                    j->status = exit_status(wait_status);
+                }
+                memmove(&j->pids[k], &j->pids[k + 1], (j->pid_count - k - 1) * sizeof(pid_t));
+                j->pid_count--;
+            }
+        }
+        if (j->pid_count == 0) {
+            j->state = JOB_DONE;
+        }
+    }
+}
+
+// Report finished jobs (only an interactive shell prints them) and drop them from the table
+void notify_jobs() {
+    int i = 0;
+    while (i < job_count) {
+        if (jobs[i].state != JOB_DONE) {
+            i++;
+            continue;
+        }
+        if (shell_interactive) {
+            print_job(&jobs[i]);
+        }
+        remove_job(&jobs[i]);
+    }
+}
+
+// Wait for a job's processes until they all exit or the job stops; returns its exit status
+int wait_job(job *j) {
+    pipeline_state ps = { j->pids, j->pid_count, j->pgid, 0, NULL };
+    int last_pending = j->pid_count > 0 && j->pids[j->pid_count - 1] == j->last_pid;
+    int wait_status = wait_pipeline(&ps);
+    j->pid_count = ps.count;
+    if (ps.stopped) {
+        j->state = JOB_STOPPED;
+        j->touched = ++job_clock;
+        return exit_status(wait_status);
+    }
+    if (last_pending) {
+        j->status = exit_status(wait_status);
+    }
+    j->state = JOB_DONE;
+    return j->status;
+}
+
+// Put a forked child shell back to plain defaults: no job control, no job table
+void enter_child_shell() {
+    if (shell_interactive) {
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        shell_interactive = 0;
+    }
+    signal(SIGCHLD, SIG_DFL);
+    while (job_count > 0) {
+        remove_job(&jobs[job_count - 1]);
+    }
+    active_metrics = NULL; // The parent measures this process as a whole
+    stats_enabled = 0;
+    forget_trace();
+}
+
+// Start node as a background job: a forked child shell in a process group of its
+// own runs it while this shell carries on. Returns 0, or 1 if it couldn't start.
+int start_background_job(command_node *node) {
+    flush_output();
+    double traced = trace_now();
+    pid_t pid = fork();
+    if (pid == -1) {
+        out_printf("Invalid Command\n");
+        return 1;
+    }
+    if (pid == 0) {
+        setpgid(0, 0);
+        if (!shell_interactive) {
+            // Without job control nothing stops a background read, so give it no input
+            int null_fd = open("/dev/null", O_RDONLY);
+            if (null_fd != -1) {
+                dup2(null_fd, STDIN_FILENO);
+                close(null_fd);
+            }
+        }
+        enter_child_shell();
+        int child_status = execute_node(node);
+        flush_output();
+        _exit(child_status); // _exit so the shared stdin buffer isn't rewound by the child
+    }
+    setpgid(pid, pid);
+    last_background_pid = pid;
+    if (trace_fd != -1) {
+        char trace_args[32];
+        snprintf(trace_args, sizeof(trace_args), "\"pid\":%d", (int)pid);
+        trace_span("shell", "fork", traced, trace_pid, trace_args);
+        trace_process_name(pid, "background job");
+    }
+
+    job *j = add_job(pid, &pid, 1, JOB_RUNNING, &node, 1);
+    if (j == NULL) {
+        out_printf("Invalid Command\n"); // Runs on, but untracked
+    } else if (shell_interactive) {
+        out_printf("[%d] %d\n", j->id, pid);
+    }
+    return 0;
+}
+
+// Handle 'jobs': list every job, then forget the finished ones
+int jobs_command(char **args) {
+    (void)args;
+    reap_jobs();
+    for (int i = 0; i < job_count; i++) {
+        print_job(&jobs[i]);
+    }
+    int i = 0;
+    while (i < job_count) {
+        if (jobs[i].state == JOB_DONE) {
+            remove_job(&jobs[i]);
+        } else {
+            i++;
+        }
+    }
+    return 0;
+}
+
+// Handle 'fg [job]': continue a job in the foreground and wait for it
+int fg_command(char **args) {
+    reap_jobs();
+    job *j = find_job(args[1]);
+    if (j == NULL) {
+        out_printf("Invalid Command\n");
+        return 1;
+    }
+    out_printf("%s\n", j->command);
+    flush_output();
+    if (shell_interactive) {
+        tcsetpgrp(STDIN_FILENO, j->pgid);
+    }
+    kill(-j->pgid, SIGCONT);
+    j->state = JOB_RUNNING;
+    j->touched = ++job_clock;
+    int status = wait_job(j);
+    take_terminal();
+    if (j->state == JOB_STOPPED) {
+        out_printf("\n");
+        print_job(j);
+    } else {
+        remove_job(j);
+    }
+    return status;
+}
+
+// Handle 'bg [job]': continue a stopped job in the background
+int bg_command(char **args) {
+    reap_jobs();
+    job *j = find_job(args[1]);
+    if (j == NULL) {
+        out_printf("Invalid Command\n");
+        return 1;
+    }
+    if (j->state == JOB_STOPPED) {
+        kill(-j->pgid, SIGCONT);
+        j->state = JOB_RUNNING;
+        j->touched = ++job_clock;
+    }
+    job *current;
+    job *previous;
+    rank_jobs(&current, &previous);
+    out_printf("[%d]%c %s &\n", j->id, j == current ? '+' : j == previous ? '-' : ' ', j->command);
+    return 0;
+}
+
+// Handle 'wait [job ...]': block until the given jobs, or all running ones, finish;
+// returns the exit status of the last job waited for
+int wait_command(char **args) {
+    int status = 0;
+    reap_jobs();
+    if (args[1] == NULL) {
+        int i = 0;
+        while (i < job_count) {
+            if (jobs[i].state == JOB_STOPPED) {
+                i++;
+                continue;
+            }
+            status = wait_job(&jobs[i]);
+            if (jobs[i].state == JOB_DONE) {
+                remove_job(&jobs[i]);
+            } else {
+                i++;
+            }
+        }
+        return status;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        job *j = find_job(args[i]);
+        if (j == NULL) {
+            out_printf("Invalid Command\n");
+            status = 127;
+            continue;
+        }
+        status = wait_job(j);
+        if (j->state == JOB_DONE) {
+            remove_job(j);
+        }
+    }
+    return status;
+}
+
+// Signal names 'kill' accepts, with or without a SIG prefix
+typedef struct {
+    const char *name;
+    int number;
+} signal_name;
+
+signal_name signal_names[] = {
+    { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+    { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "PIPE", SIGPIPE }, { "ALRM", SIGALRM },
+    { "TERM", SIGTERM }, { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP },
+    { "TTIN", SIGTTIN }, { "TTOU", SIGTTOU }
+};
+
+// Signal number for kill's -N / -NAME / -SIGNAME option, or -1
+int parse_signal(const char *option) {
+    char *end;
+    long number = strtol(option, &end, 10);
+    if (*end == '\0' && end != option) {
+        return number > 0 && number < NSIG ? (int)number : -1;
+    }
+    if (strncmp(option, "SIG", 3) == 0) {
+        option += 3;
+    }
+    for (size_t i = 0; i < sizeof(signal_names) / sizeof(signal_names[0]); i++) {
+        if (strcmp(signal_names[i].name, option) == 0) {
+            return signal_names[i].number;
+        }
+    }
+    return -1;
+}
+
+// Handle 'kill [-SIGNAL] target ...' where targets are job specs or pids; a job
+// is signalled as a whole process group
+int kill_command(char **args) {
+    int sig = SIGTERM;
+    int i = 1;
+    if (args[1] != NULL && args[1][0] == '-') {
+        sig = parse_signal(args[1] + 1);
+        if (sig == -1) {
+            out_printf("Invalid Command\n");
+            return 1;
+        }
+        i++;
+    }
+    if (args[i] == NULL) {
+        out_printf("Invalid Command\n");
+        return 1;
+    }
+
+    int status = 0;
+    for (; args[i] != NULL; i++) {
+        pid_t target;
+        job *j = NULL;
+        if (args[i][0] == '%') {
+            j = find_job(args[i]);
+            target = j != NULL ? -j->pgid : 0;
+        } else {
+            char *end;
+            long pid = strtol(args[i], &end, 10);
+            target = *end == '\0' && end != args[i] ? (pid_t)pid : 0;
+        }
+        if (target == 0 || kill(target, sig) != 0) {
+            out_printf("Invalid Command\n");
+            status = 1;
+        } else if (j != NULL && j->state == JOB_STOPPED && sig != SIGKILL && sig != SIGSTOP && sig != SIGCONT) {
+            kill(target, SIGCONT); // A stopped job only sees the signal once continued
+        }
+    }
+    return status;
+}
+
+// One run of the command given to 'parallel'
+typedef struct {
+    char **argv;             // Command with this run's input substituted
+    pid_t pid;               // Child running it, or -1 if it couldn't start
+    int pidfd;               // Readable once the child exits, or -1 without pidfd support
+    int output_fd;           // Anonymous file collecting its stdout and stderr
+    struct timespec started; // When it was launched
+    double seconds;          // Wall time it took
+    int status;              // Exit status
+    int done;                // Whether it has been reaped
+} parallel_job;
+
+// Arguments for one run of 'parallel': every {} in the command's words becomes
+// input, or input is appended when there is no {}
+char **parallel_argv(char **command, int word_count, char *input) {
+    char **argv = arena_alloc(&command_arena, (word_count + 2) * sizeof(char *));
+    size_t input_len = strlen(input);
+    int substituted = 0;
+    for (int i = 0; i < word_count; i++) {
+        char *brace = strstr(command[i], "{}");
+        if (brace == NULL) {
+            argv[i] = command[i];
+            continue;
+        }
+        int braces = 0;
+        for (char *b = brace; b != NULL; b = strstr(b + 2, "{}")) {
+            braces++;
+        }
+        char *word = arena_alloc(&command_arena, strlen(command[i]) + braces * input_len + 1);
+        char *out = word;
+        const char *in = command[i];
+        while ((brace = strstr(in, "{}")) != NULL) {
+            memcpy(out, in, brace - in);
+            out += brace - in;
+            memcpy(out, input, input_len);
+            out += input_len;
+            in = brace + 2;
+        }
+        strcpy(out, in);
+        argv[i] = word;
+        substituted = 1;
+    }
+    argv[word_count] = substituted ? NULL : input;
+    argv[word_count + 1] = NULL;
+    return argv;
+}
+
+// Reap a finished run and time it. The leader of a job-control process group is
+// only looked at (WNOWAIT): its zombie keeps the group alive for later runs.
+void finish_parallel_job(parallel_job *job, int keep_zombie) {
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    info.si_code = CLD_EXITED;
+    while (waitid(P_PID, job->pid, &info, WEXITED | (keep_zombie ? WNOWAIT : 0)) == -1 && errno == EINTR) {
+    }
+    job->status = info.si_code == CLD_EXITED ? info.si_status : 128 + info.si_status;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    job->seconds = elapsed_seconds(&job->started, &now);
+    job->done = 1;
+    if (job->pidfd != -1) {
+        close(job->pidfd);
+    }
+}
+
+// Copy a finished run's collected output to stdout in one piece
+void emit_parallel_output(parallel_job *job) {
+    if (job->output_fd == -1) {
+        return;
+    }
+    flush_output();
+    if (lseek(job->output_fd, 0, SEEK_SET) == 0) {
+        copy_fd(job->output_fd, STDOUT_FILENO);
+    }
+    close(job->output_fd);
+    job->output_fd = -1;
+}
+
+// Handle 'parallel [-j N] [-k] command ... ::: input ...': run the command once per
+// input, N at a time (default: one per CPU). Each run's stdout and stderr go to an
+// anonymous file copied out whole when it finishes, or in input order with -k, so
+// outputs never interleave. Runs are reaped from a single poll loop over their
+// pidfds, and the timings are reported on stderr. Returns the number of failed
+// runs, at most 101, as GNU parallel does.
+int parallel_command(char **args) {
+    long limit = sysconf(_SC_NPROCESSORS_ONLN);
+    int keep_order = 0;
+    int i = 1;
+    while (args[i] != NULL && args[i][0] == '-') {
+        if (strcmp(args[i], "-k") == 0) {
+            keep_order = 1;
+            i++;
+        } else if (strncmp(args[i], "-j", 2) == 0) {
+            const char *value = args[i][2] != '\0' ? args[i] + 2 : args[i + 1];
+            char *end = NULL;
+            limit = value != NULL ? strtol(value, &end, 10) : 0;
+            if (value == NULL || *end != '\0' || end == value || limit < 1) {
+                out_printf("Invalid Command\n");
+                return 1;
+            }
+            i += args[i][2] != '\0' ? 1 : 2;
+        } else {
+            break;
+        }
+    }
+    int command_start = i;
+    while (args[i] != NULL && strcmp(args[i], ":::") != 0) {
+        i++;
+    }
+    int word_count = i - command_start;
+    if (args[i] == NULL || word_count == 0 || args[i + 1] == NULL) {
+        out_printf("Invalid Command\n");
+        return 1;
+    }
+    char **inputs = &args[i + 1];
+    int job_total = 0;
+    while (inputs[job_total] != NULL) {
+        job_total++;
+    }
+    if (limit < 1 || limit > job_total) {
+        limit = job_total;
+    }
+
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (null_fd == -1) {
+        out_printf("Invalid Command\n");
+        return 1;
+    }
+    parallel_job *runs = arena_alloc(&command_arena, job_total * sizeof(parallel_job));
+    struct pollfd *polls = arena_alloc(&command_arena, limit * sizeof(struct pollfd));
+    int *running = arena_alloc(&command_arena, limit * sizeof(int)); // Index in runs of each entry in polls
+    pipeline_state ps = { arena_alloc(&command_arena, job_total * sizeof(pid_t)), 0, 0, 0, NULL };
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int next = 0;        // Next input to start
+    int active = 0;      // Runs in polls
+    int emit_next = 0;   // With -k, the next run whose output is due
+    int interrupted = 0; // Set when Ctrl-C killed a run: start no more
+    while (active > 0 || (next < job_total && !interrupted)) {
+        while (active < limit && next < job_total && !interrupted) {
+            parallel_job *job = &runs[next++];
+            job->argv = parallel_argv(&args[command_start], word_count, inputs[next - 1]);
+            job->pid = -1;
+            job->pidfd = -1;
+            job->status = 127;
+            job->seconds = 0;
+            job->done = 0;
+            job->output_fd = memfd_create("parallel", MFD_CLOEXEC);
+            clock_gettime(CLOCK_MONOTONIC, &job->started);
+            if (job->output_fd != -1) {
+                fd_action stderr_action = { STDERR_FILENO, job->output_fd, 0 };
+                job->pid = launch_command(job->argv, null_fd, job->output_fd, &stderr_action, 1, stage_group(&ps));
+            }
+            if (job->pid <= 0) {
+                out_printf("Invalid Command\n");
+                job->done = 1;
+                continue;
+            }
+            add_stage(&ps, job->pid);
+            job->pidfd = syscall(SYS_pidfd_open, job->pid, 0);
+            polls[active].fd = job->pidfd;
+            polls[active].events = POLLIN;
+            polls[active].revents = 0;
+            running[active++] = job - runs;
+        }
+
+        // Sleep until a child exits; one without a pidfd is simply waited for
+        int blocking = -1;
+        for (int k = 0; k < active && blocking == -1; k++) {
+            if (polls[k].fd == -1) {
+                blocking = k;
+            }
+        }
+        if (blocking != -1) {
+            for (int k = 0; k < active; k++) {
+                polls[k].revents = k == blocking ? POLLIN : 0;
+            }
+        } else if (active > 0 && poll(polls, active, -1) == -1) {
+            continue; // EINTR, e.g. SIGCHLD
+        }
+
+        for (int k = active - 1; k >= 0; k--) {
+            if (polls[k].revents == 0) {
+                continue;
+            }
+            parallel_job *job = &runs[running[k]];
+            finish_parallel_job(job, job->pid == ps.pgid);
+            if (job->status == 128 + SIGINT) {
+                interrupted = 1;
+            }
+            if (!keep_order) {
+                emit_parallel_output(job);
+            }
+            polls[k] = polls[active - 1];
+            running[k] = running[active - 1];
+            active--;
+        }
+        while (emit_next < next && runs[emit_next].done) {
+            emit_parallel_output(&runs[emit_next++]); // Already emitted without -k
+        }
+    }
+    if (ps.pgid > 0) {
+        waitpid(ps.pgid, NULL, 0); // The group leader's zombie
+    }
+    take_terminal();
+    close(null_fd);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double summed = 0;
+    int failed = 0;
+    for (int k = 0; k < next; k++) {
+        err_printf("parallel: [%d] %.3fs exit %d:", k + 1, runs[k].seconds, runs[k].status);
+        for (char **word = runs[k].argv; *word != NULL; word++) {
+            err_printf(" %s", *word);
+        }
+        err_printf("\n");
+        summed += runs[k].seconds;
+        failed += runs[k].status != 0;
+    }
+    err_printf("parallel: %d jobs, %ld at a time, %.3fs wall, %.3fs summed\n", next, limit,
+            elapsed_seconds(&start, &end), summed);
+    return failed > 101 ? 101 : failed;
+}
+
+// State of one 'grep' run
+typedef struct {
+    int invert;          // -v: select the lines that don't match
+    int count_only;      // -c: print a count per input instead of lines
+    int quiet;           // -q: print nothing and stop at the first selected line
+    int line_numbers;    // -n: prefix lines with their number
+    int list_files;      // -l: print the names of inputs with a selected line
+    int with_names;      // Prefix output with the input's name
+    const char *literal; // Fixed string searched with memmem, or NULL to use regex
+    size_t literal_len;
+    regex_t regex;       // Compiled pattern when there is no literal
+    const char *name;    // Name of the input being searched
+    long line_no;        // Number of the line starting at counted (-n)
+    const char *counted; // Line start up to which lines have been counted
+    long selected;       // Lines selected in the current input
+} grep_state;
+
+// Number of newlines in [from, to)
+long count_newlines(const char *from, const char *to) {
+    long count = 0;
+    while (from < to && (from = memchr(from, '\n', to - from)) != NULL) {
+        count++;
+        from++;
+    }
+    return count;
+}
+
+// Start of the first match in [pos, end) of buf, or NULL
+const char *grep_find(grep_state *g, const char *buf, const char *pos, const char *end) {
+    if (g->literal != NULL) {
+        return memmem(pos, end - pos, g->literal, g->literal_len); // glibc: two-way search, SIMD first-byte scan
+    }
+    regmatch_t match;
+    match.rm_so = pos - buf;
+    match.rm_eo = end - buf;
+    if (regexec(&g->regex, buf, 1, &match, REG_STARTEND) != 0) {
+        return NULL;
+    }
+    return buf + match.rm_so;
+}
+
+// Take a selected line (without its newline); returns 1 when the rest of the
+// input doesn't matter (-q, -l)
+int grep_select(grep_state *g, const char *line, const char *line_end) {
+    g->selected++;
+    if (g->quiet || g->list_files) {
+        return 1;
+    }
+    if (g->count_only) {
+        return 0;
+    }
+    if (g->with_names) {
+        out_printf("%s:", g->name);
+    }
+    if (g->line_numbers) {
+        g->line_no += count_newlines(g->counted, line);
+        g->counted = line;
+        out_printf("%ld:", g->line_no);
+    }
+    out_write(line, line_end - line);
+    out_putc('\n');
+    return 0;
+}
+
+// Search whole lines in buf (the last one may lack its newline at the end of the
+// input). Rather than testing line by line, each search runs to the next match
+// and only that line is picked out. Returns 1 to stop searching the input.
+int grep_buffer(grep_state *g, const char *buf, size_t len) {
+    const char *end = buf + len;
+    const char *pos = buf;
+    g->counted = buf;
+    while (pos < end) {
+        const char *hit = grep_find(g, buf, pos, end);
+        const char *line = end; // Start of the line holding the match
+        if (hit != NULL) {
+            const char *newline = memrchr(pos, '\n', hit - pos);
+            line = newline != NULL ? newline + 1 : pos;
+            if (line == end) {
+                hit = NULL; // An empty match past the last newline: there is no line there
+            }
+        }
+        if (g->invert) {
+            // Every line before the matching one is selected
+            while (pos < line) {
+                const char *newline = memchr(pos, '\n', line - pos);
+                const char *line_end = newline != NULL ? newline : line;
+                if (grep_select(g, pos, line_end)) {
+                    return 1;
+                }
+                pos = line_end + 1;
+            }
+        }
+        if (hit == NULL) {
+            break;
+        }
+        const char *newline = memchr(hit, '\n', end - hit);
+        const char *line_end = newline != NULL ? newline : end;
+        if (!g->invert && grep_select(g, line, line_end)) {
+            return 1;
+        }
+        pos = line_end + 1;
+    }
+    if (g->line_numbers) {
+        g->line_no += count_newlines(g->counted, end);
+    }
+    return 0;
+}
+
+// Search one input: regular files are mapped, anything else is read in large
+// blocks and searched a run of whole lines at a time. Returns 0, or -1 on a read error.
+int grep_fd(grep_state *g, int fd) {
+    g->selected = 0;
+    g->line_no = 1;
+    struct stat st;
+    int regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (regular && st.st_size > 0) {
+        off_t start = lseek(fd, 0, SEEK_CUR); // Input redirected from a file may not be at its start
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            if (start >= 0 && start < st.st_size) {
+                grep_buffer(g, map + start, st.st_size - start);
+            }
+            munmap(map, st.st_size);
+            return 0;
+        }
+    }
+
+    size_t capacity = GREP_BUFFER_SIZE;
+    size_t used = 0;
+    char *buffer = malloc(capacity);
+    if (buffer == NULL) {
+        return -1;
+    }
+    int result = 0;
+    while (1) {
+        if (!regular) { // A pipe or terminal may make the read wait
+            flush_output(); // Matches so far shouldn't wait on the writer
+        }
+        if (used == capacity) {
+            // A line longer than the buffer
+            char *grown = realloc(buffer, 2 * capacity);
+            if (grown == NULL) {
+                result = -1;
+                break;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+        ssize_t n = read(fd, buffer + used, capacity - used);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            result = -1;
+            break;
+        }
+        if (n == 0) {
+            if (used > 0) {
+                grep_buffer(g, buffer, used);
+            }
+            break;
+        }
+        used += n;
+        char *last_newline = memrchr(buffer + used - n, '\n', n);
+        if (last_newline == NULL) {
+            continue;
+        }
+        size_t complete = last_newline + 1 - buffer;
+        if (grep_buffer(g, buffer, complete)) {
+            break;
+        }
+        memmove(buffer, buffer + complete, used - complete);
+        used -= complete;
+    }
+    free(buffer);
+    return result;
+}
+
+// Run the system grep for options the builtin doesn't implement; returns its exit status
+int grep_with_system(char **args) {
+    pid_t pid = launch_command(args, STDIN_FILENO, STDOUT_FILENO, NULL, 0, -1);
+    if (pid <= 0) {
+        out_printf("Invalid Command\n");
+        return 2;
+    }
+    int wait_status = 0;
+    while (waitpid(pid, &wait_status, 0) == -1 && errno == EINTR) {
+    }
+    int status = exit_status(wait_status);
+    if (status > 1) {
+        out_printf("Invalid Command\n"); // 1 only means no match
+    }
+    return status;
+}
+
+// Handle 'grep [-icnqvlhHsFEG] [-e] pattern [file ...]' without starting a process.
+// Fixed strings are found with memmem; other patterns go through POSIX regex.
+// Exit status as grep's: 0 if a line was selected, 1 if none, 2 on an error.
+int grep_command(char **args) {
+    grep_state g;
+    memset(&g, 0, sizeof(g));
+    int extended = 0;
+    int fixed = 0;
+    int ignore_case = 0;
+    int names = -1; // -H / -h, or -1 to decide by the number of files
+    int no_messages = 0;
+    const char *pattern = NULL;
+
+    int i = 1;
+    int options_ended = 0; // Past a "--"
+    while (args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0' && pattern == NULL) {
+        if (strcmp(args[i], "--") == 0) {
+            options_ended = 1;
+            i++;
+            break;
+        }
+        if (args[i][1] == '-') {
+            return grep_with_system(args); // Long options
+        }
+        for (char *opt = args[i] + 1; *opt != '\0' && pattern == NULL; opt++) {
+            switch (*opt) {
+            case 'i':
+                ignore_case = 1;
+                break;
+            case 'v':
+                g.invert = 1;
+                break;
+            case 'c':
+                g.count_only = 1;
+                break;
+            case 'q':
+                g.quiet = 1;
+                break;
+            case 'n':
+                g.line_numbers = 1;
+                break;
+            case 'l':
+                g.list_files = 1;
+                break;
+            case 'H':
+                names = 1;
+                break;
+            case 'h':
+                names = 0;
+                break;
+            case 's':
+                no_messages = 1;
+                break;
+            case 'F':
+                fixed = 1;
+                break;
+            case 'E':
+                extended = 1;
+                break;
+            case 'G':
+                extended = 0;
+                break;
+            case 'e':
+                pattern = opt[1] != '\0' ? opt + 1 : args[++i];
+                if (pattern == NULL) {
+                    out_printf("Invalid Command\n");
+                    return 2;
+                }
+                break;
+            default:
+                return grep_with_system(args);
+            }
+        }
+        i++;
+    }
+    // GNU grep also takes options after the pattern (or a later "--"), and -e more
+    // than once: leave any call with one left in it to the real grep
+    for (int k = i; !options_ended && args[k] != NULL; k++) {
+        if (args[k][0] == '-' && args[k][1] != '\0') {
+            return grep_with_system(args);
+        }
+    }
+    if (pattern == NULL) {
+        pattern = args[i];
+        if (pattern == NULL) {
+            out_printf("Invalid Command\n"); // grep needs at least a pattern
+            return 2;
+        }
+        i++;
+    }
+    char **files = &args[i];
+    g.with_names = names != -1 ? names : files[0] != NULL && files[1] != NULL;
+
+    // Patterns without special characters skip the regex engine unless case is folded
+    const char *special = extended ? "\\.[]*^$+?(){}|" : "\\.[]*^$";
+    int literal = fixed || strpbrk(pattern, special) == NULL;
+    if (literal && !ignore_case) {
+        g.literal = pattern;
+        g.literal_len = strlen(pattern);
+    } else {
+        const char *source = pattern;
+        if (literal) {
+            // Escape it into a basic regex, just to get REG_ICASE
+            char *escaped = arena_alloc(&command_arena, 2 * strlen(pattern) + 1);
+            char *out = escaped;
+            for (const char *c = pattern; *c != '\0'; c++) {
+                if (strchr("\\.[]*^$", *c) != NULL) {
+                    *out++ = '\\';
+                }
+                *out++ = *c;
+            }
+            *out = '\0';
+            source = escaped;
+            extended = 0;
+        }
+        int flags = REG_NEWLINE | (extended ? REG_EXTENDED : 0) | (ignore_case ? REG_ICASE : 0);
+        int err = regcomp(&g.regex, source, flags);
+        if (err != 0) {
+            char message[256];
+            regerror(err, &g.regex, message, sizeof(message));
+            err_printf("grep: %s\n", message);
+            out_printf("Invalid Command\n");
+            return 2;
+        }
+    }
+
+    flush_output();
+    int matched = 0;
+    int failed = 0;
+    for (int f = 0; f == 0 || files[f] != NULL; f++) {
+        int fd = STDIN_FILENO;
+        g.name = "(standard input)";
+        if (files[f] != NULL && strcmp(files[f], "-") != 0) {
+            g.name = files[f];
+            fd = open(files[f], O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                if (!no_messages) {
+                    err_printf("grep: %s: %s\n", files[f], strerror(errno));
+                }
+                failed = 1;
+                continue;
+            }
+        }
+        if (grep_fd(&g, fd) != 0) {
+            if (!no_messages) {
+                err_printf("grep: %s: %s\n", g.name, strerror(errno));
+            }
+            failed = 1;
+        }
+        if (fd != STDIN_FILENO) {
+            close(fd);
+        }
+
+        matched |= g.selected > 0;
+        if (g.quiet && matched) {
+            break;
+        }
+        if (g.list_files && g.selected > 0) {
+            out_printf("%s\n", g.name);
+        } else if (g.count_only && !g.list_files) {
+            if (g.with_names) {
+                out_printf("%s:", g.name);
+            }
+            out_printf("%ld\n", g.selected);
+        }
+        if (files[f] == NULL) {
+            break; // Only stdin
+        }
+    }
+    if (g.literal == NULL) {
+        regfree(&g.regex);
+    }
+
+    if (g.quiet && matched) {
+        return 0;
+    }
+    if (failed) {
+        out_printf("Invalid Command\n");
+        return 2;
+    }
+    return matched ? 0 : 1;
+}
+
+// Options of one 'ls' run
+typedef struct {
+    int all;            // -a: list every entry, . and .. included
+    int almost_all;     // -A: list dotfiles but not . and ..
+    int long_format;    // -l
+    int one_per_line;   // -1, and always when stdout isn't a terminal
+    int reverse;        // -r
+    int by_time;        // -t: newest first
+    int by_size;        // -S: largest first
+    int directory;      // -d: list directories themselves, not their contents
+    int human;          // -h: sizes like 4.0K in the long format
+    unsigned int mask;  // STATX_* fields the options need, 0 to skip statx
+    time_t now;         // For picking the long format's date style
+    uid_t user_id;      // Owner looked up last, with its name (listings rarely mix owners)
+    char user[32];
+    gid_t group_id;     // Group looked up last, with its name
+    char group[32];
+} ls_options;
+
+// One name to list. Sorting swaps these small records, and comparing their
+// keys settles most name orderings without touching the names themselves.
+typedef struct {
+    uint64_t key;      // First eight bytes of the name, big-endian and zero-padded
+    const char *name;  // Name as listed, NUL-terminated
+    struct statx *st;  // Metadata when the options need any, else NULL
+} ls_entry;
+
+// Entries of a listing, with their metadata
+typedef struct {
+    ls_entry *entries;
+    size_t count;
+    size_t capacity;
+    struct statx *stats; // One per entry, allocated only when opts->mask is set
+} ls_list;
+
+// First eight bytes of a name packed so that comparing keys orders names as strcmp
+uint64_t ls_name_key(const char *name) {
+    uint64_t key = 0;
+    for (int i = 0; i < 8; i++) {
+        key <<= 8;
+        if (*name != '\0') {
+            key |= (unsigned char)*name++;
+        }
+    }
+    return key;
+}
+
+// Order of two entries for qsort_r: by the -t/-S field if any, then by name
+int compare_ls_entries(const void *a, const void *b, void *context) {
+    const ls_entry *x = a;
+    const ls_entry *y = b;
+    const ls_options *opts = context;
+    int result = 0;
+    if (opts->by_time) {
+        if (x->st->stx_mtime.tv_sec != y->st->stx_mtime.tv_sec) {
+            result = x->st->stx_mtime.tv_sec > y->st->stx_mtime.tv_sec ? -1 : 1;
+        } else if (x->st->stx_mtime.tv_nsec != y->st->stx_mtime.tv_nsec) {
+            result = x->st->stx_mtime.tv_nsec > y->st->stx_mtime.tv_nsec ? -1 : 1;
+        }
+    } else if (opts->by_size && x->st->stx_size != y->st->stx_size) {
+        result = x->st->stx_size > y->st->stx_size ? -1 : 1;
+    }
+    if (result == 0) {
+        if (x->key != y->key) {
+            result = x->key < y->key ? -1 : 1;
+        } else if ((x->key & 0xff) != 0) {
+            result = strcmp(x->name + 8, y->name + 8); // Same first eight bytes, and both go on
+        }
+    }
+    return opts->reverse ? -result : result;
+}
+
+// Append a name to a listing; returns 0, or an errno value
+int add_ls_entry(ls_list *list, const char *name) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity == 0 ? 256 : 2 * list->capacity;
+        ls_entry *grown = realloc(list->entries, capacity * sizeof(ls_entry));
+        if (grown == NULL) {
+            return ENOMEM;
+        }
+        list->entries = grown;
+        list->capacity = capacity;
+    }
+    ls_entry *e = &list->entries[list->count++];
+    e->key = ls_name_key(name);
+    e->name = name;
+    e->st = NULL;
+    return 0;
+}
+
+// Read the names in a directory with getdents64, a large batch per call. The
+// batches are copied into the command arena whole, so the entries point at
+// the names in place. Returns 0, or an errno value.
+int read_ls_directory(int dir_fd, ls_options *opts, ls_list *list) {
+    char *buffer = malloc(LS_BUFFER_SIZE);
+    if (buffer == NULL) {
+        return ENOMEM;
+    }
+    int error = 0;
+    ssize_t n;
+    while (error == 0 && (n = getdents64(dir_fd, buffer, LS_BUFFER_SIZE)) > 0) {
+        char *batch = arena_alloc(&command_arena, n);
+        memcpy(batch, buffer, n);
+        for (ssize_t offset = 0; offset < n && error == 0;) {
+            struct dirent64 *d = (struct dirent64 *)(batch + offset);
+            offset += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && !opts->all) {
+                int dot_or_dotdot = name[1] == '\0' || (name[1] == '.' && name[2] == '\0');
+                if (!opts->almost_all || dot_or_dotdot) {
+                    continue;
+                }
+            }
+            error = add_ls_entry(list, name);
+        }
+    }
+    if (error == 0 && n < 0) {
+        error = errno;
+    }
+    free(buffer);
+    return error;
+}
+
+// Fetch the fields opts->mask asks for, relative to dir_fd, then sort the listing.
+// Entries that vanished since they were read are dropped. Returns 0, or an errno value.
+int stat_and_sort_ls(int dir_fd, ls_options *opts, ls_list *list) {
+    if (opts->mask != 0 && list->count > 0) {
+        list->stats = malloc(list->count * sizeof(struct statx));
+        if (list->stats == NULL) {
+            return ENOMEM;
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < list->count; i++) {
+            ls_entry e = list->entries[i];
+            if (statx(dir_fd, e.name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, opts->mask, &list->stats[kept]) == 0) {
+                e.st = &list->stats[kept];
+                list->entries[kept++] = e;
+            }
+        }
+        list->count = kept;
+    }
+    if (list->count > 1) {
+        qsort_r(list->entries, list->count, sizeof(ls_entry), compare_ls_entries, opts);
+    }
+    return 0;
+}
+
+void free_ls_list(ls_list *list) {
+    free(list->entries);
+    free(list->stats);
+    memset(list, 0, sizeof(*list));
+}
+
+// Name of the owner for the long format, or its number if it has none
+const char *ls_user_name(ls_options *opts, uid_t uid) {
+    if (opts->user[0] == '\0' || opts->user_id != uid) {
+        struct passwd *pw = getpwuid(uid);
+        if (pw != NULL) {
+            snprintf(opts->user, sizeof(opts->user), "%s", pw->pw_name);
+        } else {
+            snprintf(opts->user, sizeof(opts->user), "%u", (unsigned int)uid);
+        }
+        opts->user_id = uid;
+    }
+    return opts->user;
+}
+
+// Name of the group for the long format, or its number if it has none
+const char *ls_group_name(ls_options *opts, gid_t gid) {
+    if (opts->group[0] == '\0' || opts->group_id != gid) {
+        struct group *gr = getgrgid(gid);
+        if (gr != NULL) {
+            snprintf(opts->group, sizeof(opts->group), "%s", gr->gr_name);
+        } else {
+            snprintf(opts->group, sizeof(opts->group), "%u", (unsigned int)gid);
+        }
+        opts->group_id = gid;
+    }
+    return opts->group;
+}
+
+// Size as the long format shows it: bytes, or rounded up to K, M, ... with -h
+void format_ls_size(ls_options *opts, unsigned long long size, char *buf, size_t len) {
+    if (!opts->human || size < 1024) {
+        snprintf(buf, len, "%llu", size);
+        return;
+    }
+    const char *units = "KMGTPE";
+    int unit = 0;
+    double value = size / 1024.0;
+    while (value >= 1024 && unit < 5) {
+        value /= 1024;
+        unit++;
+    }
+    unsigned long long tenths = value * 10;
+    if (tenths < value * 10) {
+        tenths++;
+    }
+    if (tenths < 100) {
+        snprintf(buf, len, "%llu.%llu%c", tenths / 10, tenths % 10, units[unit]);
+    } else {
+        unsigned long long whole = value;
+        snprintf(buf, len, "%llu%c", whole + (whole < value), units[unit]);
+    }
+}
+
+// Type and permission bits as "drwxr-xr-x"
+void format_ls_mode(unsigned int mode, char *buf) {
+    buf[0] = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : S_ISCHR(mode) ? 'c' : S_ISBLK(mode) ? 'b'
+           : S_ISFIFO(mode) ? 'p' : S_ISSOCK(mode) ? 's' : '-';
+    for (int i = 0; i < 9; i++) {
+        buf[1 + i] = (mode & (0400 >> i)) ? "rwxrwxrwx"[i] : '-';
+    }
+    if (mode & S_ISUID) {
+        buf[3] = buf[3] == 'x' ? 's' : 'S';
+    }
+    if (mode & S_ISGID) {
+        buf[6] = buf[6] == 'x' ? 's' : 'S';
+    }
+    if (mode & S_ISVTX) {
+        buf[9] = buf[9] == 'x' ? 't' : 'T';
+    }
+    buf[10] = '\0';
+}
+
+// Widen the long format's columns (links, owner, group, size, and a device's
+// major and minor numbers within size) to fit a listing's values; returns the blocks its entries use, in 512-byte units
+unsigned long long measure_ls_long(ls_options *opts, ls_list *list, int *widths) {
+    unsigned long long blocks = 0;
+    char text[64];
+    for (size_t i = 0; i < list->count; i++) {
+        struct statx *st = list->entries[i].st;
+        int len = snprintf(text, sizeof(text), "%u", st->stx_nlink);
+        widths[0] = len > widths[0] ? len : widths[0];
+        len = strlen(ls_user_name(opts, st->stx_uid));
+        widths[1] = len > widths[1] ? len : widths[1];
+        len = strlen(ls_group_name(opts, st->stx_gid));
+        widths[2] = len > widths[2] ? len : widths[2];
+        if (S_ISCHR(st->stx_mode) || S_ISBLK(st->stx_mode)) {
+            len = snprintf(text, sizeof(text), "%u", st->stx_rdev_major);
+            widths[4] = len > widths[4] ? len : widths[4];
+            len = snprintf(text, sizeof(text), "%u", st->stx_rdev_minor);
+            widths[5] = len > widths[5] ? len : widths[5];
+            len = widths[4] + 2 + widths[5];
+        } else {
+            format_ls_size(opts, st->stx_size, text, sizeof(text));
+            len = strlen(text);
+        }
+        widths[3] = len > widths[3] ? len : widths[3];
+        blocks += st->stx_blocks;
+    }
+    return blocks;
+}
+
+// Print a listing one entry per line with mode, links, owner, group, size and
+// date, the columns sized to their widest value. Directory operands, listed
+// later, are measured along with file operands as ls does; a directory's own
+// listing (operand_dirs NULL) starts with its total.
+void print_ls_long(int dir_fd, ls_options *opts, ls_list *list, ls_list *operand_dirs) {
+    int widths[6] = { 0, 0, 0, 0, 0, 0 }; // Links, owner, group, size, major, minor
+    unsigned long long blocks = measure_ls_long(opts, list, widths);
+    char text[64];
+    if (operand_dirs != NULL) {
+        measure_ls_long(opts, operand_dirs, widths);
+    } else {
+        // stx_blocks counts 512-byte units; the total is in 1K blocks, or bytes for -h
+        format_ls_size(opts, opts->human ? blocks * 512 : (blocks + 1) / 2, text, sizeof(text));
+        out_printf("total %s\n", text);
+    }
+
+    for (size_t i = 0; i < list->count; i++) {
+        ls_entry *e = &list->entries[i];
+        struct statx *st = e->st;
+        char mode[11];
+        format_ls_mode(st->stx_mode, mode);
+        if (S_ISCHR(st->stx_mode) || S_ISBLK(st->stx_mode)) {
+            snprintf(text, sizeof(text), "%*u, %*u", widths[4], st->stx_rdev_major, widths[5], st->stx_rdev_minor);
+        } else {
+            format_ls_size(opts, st->stx_size, text, sizeof(text));
+        }
+        // Files older than about six months, or in the future, show the year instead of the time
+        time_t mtime = st->stx_mtime.tv_sec;
+        struct tm tm;
+        char date[32];
+        localtime_r(&mtime, &tm);
+        int recent = mtime <= opts->now && opts->now - mtime < 31556952 / 2;
+        strftime(date, sizeof(date), recent ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+        out_printf("%s %*u %-*s %-*s %*s %s %s", mode, widths[0], st->stx_nlink,
+               widths[1], ls_user_name(opts, st->stx_uid), widths[2], ls_group_name(opts, st->stx_gid),
+               widths[3], text, date, e->name);
+        if (S_ISLNK(st->stx_mode)) {
+            char target[4096];
+            ssize_t len = readlinkat(dir_fd, e->name, target, sizeof(target) - 1);
+            if (len >= 0) {
+                target[len] = '\0';
+                out_printf(" -> %s", target);
+            }
+        }
+        out_putc('\n');
+    }
+}
+
+// Print names down columns across the terminal's width, as ls does on a
+// terminal: the most columns whose widths, plus two spaces between, still fit
+void print_ls_columns(ls_list *list) {
+    int width = 80;
+    struct winsize ws;
+    const char *columns = getenv("COLUMNS");
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+        width = ws.ws_col;
+    } else if (columns != NULL && atoi(columns) > 0) {
+        width = atoi(columns);
+    }
+
+    size_t count = list->count;
+    size_t *lengths = malloc((count + 1) * sizeof(size_t));
+    size_t *widths = malloc((count + 1) * sizeof(size_t));
+    if (lengths == NULL || widths == NULL) {
+        free(lengths);
+        free(widths);
+        for (size_t i = 0; i < count; i++) {
+            out_printf("%s\n", list->entries[i].name);
+        }
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        lengths[i] = strlen(list->entries[i].name);
+    }
+
+    // The narrowest possible column is a one-byte name plus its two-space gap
+    size_t rows = count;
+    size_t cols = 1;
+    size_t most = (size_t)width / 3 + 1;
+    for (size_t try = most < count ? most : count; try > 1; try--) {
+        size_t try_rows = (count + try - 1) / try;
+        size_t try_cols = (count + try_rows - 1) / try_rows;
+        size_t total = 0;
+        for (size_t c = 0; c < try_cols && total <= (size_t)width; c++) {
+            size_t widest = 0;
+            for (size_t r = 0; r < try_rows && c * try_rows + r < count; r++) {
+                widest = lengths[c * try_rows + r] > widest ? lengths[c * try_rows + r] : widest;
+            }
+            widths[c] = widest;
+            total += widest + (c + 1 < try_cols ? 2 : 0);
+        }
+        if (total < (size_t)width) {
+            rows = try_rows;
+            cols = try_cols;
+            break;
+        }
+    }
+    if (cols == 1) {
+        rows = count;
+    } else {
+        // Recompute the widths of the layout chosen
+        for (size_t c = 0; c < cols; c++) {
+            widths[c] = 0;
+            for (size_t r = 0; r < rows && c * rows + r < count; r++) {
+                widths[c] = lengths[c * rows + r] > widths[c] ? lengths[c * rows + r] : widths[c];
+            }
+        }
+    }
+
+    for (size_t r = 0; r < rows; r++) {
+        size_t column = 0; // Where the cursor is on the line
+        size_t start = 0;  // Where the current name's column starts
+        for (size_t c = 0; c < cols; c++) {
+            size_t i = c * rows + r;
+            if (i >= count) {
+                break;
+            }
+            out_write(list->entries[i].name, strlen(list->entries[i].name));
+            column += lengths[i];
+            start += widths[c] + 2;
+            if (c + 1 < cols && i + rows < count) {
+                // Pad with tabs where one reaches a stop before the next column, as ls does
+                while (column < start) {
+                    if (start / 8 > (column + 1) / 8) {
+                        out_putc('\t');
+                        column += 8 - column % 8;
+                    } else {
+                        out_putc(' ');
+                        column++;
+                    }
+                }
+            }
+        }
+        out_putc('\n');
+    }
+    free(lengths);
+    free(widths);
+}
+
+void print_ls_list(int dir_fd, ls_options *opts, ls_list *list, ls_list *operand_dirs) {
+    if (opts->long_format) {
+        print_ls_long(dir_fd, opts, list, operand_dirs);
+    } else if (opts->one_per_line) {
+        for (size_t i = 0; i < list->count; i++) {
+            out_write(list->entries[i].name, strlen(list->entries[i].name));
+            out_putc('\n');
+        }
+    } else if (list->count > 0) {
+        print_ls_columns(list);
+    }
+}
+
+// List the contents of one directory; returns 0, or an errno value
+int list_ls_directory(const char *path, ls_options *opts) {
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) {
+        return errno;
+    }
+    ls_list list;
+    memset(&list, 0, sizeof(list));
+    int error = read_ls_directory(dir_fd, opts, &list);
+    if (error == 0) {
+        error = stat_and_sort_ls(dir_fd, opts, &list);
+    }
+    if (error == 0) {
+        print_ls_list(dir_fd, opts, &list, NULL);
+    }
+    free_ls_list(&list);
+    close(dir_fd);
+    return error;
+}
+
+// Run the system ls for options the builtin doesn't implement. Anything it
+// writes to stderr, or a failure, is reported as "Invalid Command".
+int ls_with_system(char **args) {
+    int stderr_fd[2];
+    if (pipe2(stderr_fd, O_CLOEXEC) != 0) {
+        out_printf("Invalid Command\n");
+        return 2;
+    }
+    fd_action to_pipe = { STDERR_FILENO, stderr_fd[1], 0 };
+    pid_t pid = launch_command(args, STDIN_FILENO, STDOUT_FILENO, &to_pipe, 1, -1);
+    close(stderr_fd[1]);
+    if (pid <= 0) {
+        close(stderr_fd[0]);
+        out_printf("Invalid Command\n");
+        return 127;
+    }
+    // Drain the pipe so ls never blocks on it; only whether anything came matters
+    char error_buffer[1024];
+    size_t error_len = 0;
+    ssize_t n;
+    while ((n = read(stderr_fd[0], error_buffer, sizeof(error_buffer))) != 0) {
+        if (n > 0) {
+            error_len += n;
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+    close(stderr_fd[0]);
+
+    int wait_status = 0;
+    while (waitpid(pid, &wait_status, 0) == -1 && errno == EINTR) {
+    }
+    int status = exit_status(wait_status);
+    if (status != 0 || error_len > 0) {
+        out_printf("Invalid Command\n");
+        if (status == 0) {
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// Handle 'ls [-aAlrtSdh1] [file ...]' without starting a process. Directories
+// are read with getdents64, and statx is only called when -l, -t or -S need
+// metadata. Operands that can't be listed are reported as "Invalid Command"
+// after the rest are listed, with exit status 2 as ls.
+int ls_command(char **args) {
+    ls_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.one_per_line = !isatty(STDOUT_FILENO);
+
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (char *opt = args[i] + 1; *opt != '\0'; opt++) {
+            switch (*opt) {
+            case 'a':
+                opts.all = 1;
+                break;
+            case 'A':
+                opts.almost_all = 1;
+                break;
+            case 'l':
+                opts.long_format = 1;
+                break;
+            case '1':
+                opts.one_per_line = 1;
+                break;
+            case 'r':
+                opts.reverse = 1;
+                break;
+            case 't':
+                opts.by_time = 1;
+                break;
+            case 'S':
+                opts.by_size = 1;
+                break;
+            case 'd':
+                opts.directory = 1;
+                break;
+            case 'h':
+                opts.human = 1;
+                break;
+            default:
+                return ls_with_system(args); // Long options and the rest of ls's letters
+            }
+        }
+    }
+    if (opts.long_format) {
+        opts.mask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID
+                  | STATX_SIZE | STATX_MTIME | STATX_BLOCKS;
+        opts.now = time(NULL);
+    } else {
+        opts.mask = (opts.by_time ? STATX_MTIME : 0) | (opts.by_size ? STATX_SIZE : 0);
+    }
+
+    // Sort the operands into files, listed together first, and directories,
+    // listed one after another; those that don't exist are errors
+    char *dot[] = { ".", NULL };
+    char **operands = args[i] != NULL ? args + i : dot;
+    int operand_count = 0;
+    while (operands[operand_count] != NULL) {
+        operand_count++;
+    }
+    ls_list files;
+    ls_list dirs;
+    memset(&files, 0, sizeof(files));
+    memset(&dirs, 0, sizeof(dirs));
+    struct statx *operand_stats = malloc(operand_count * sizeof(struct statx));
+    if (operand_stats == NULL) {
+        out_printf("Invalid Command\n");
+        return 2;
+    }
+    int errors = 0;
+    unsigned int operand_mask = opts.mask | STATX_TYPE;
+    for (int k = 0; k < operand_count; k++) {
+        // Only the long format shows a symlink operand itself rather than what it names
+        int flags = opts.long_format || opts.directory ? AT_SYMLINK_NOFOLLOW : 0;
+        if (statx(AT_FDCWD, operands[k], flags | AT_NO_AUTOMOUNT, operand_mask, &operand_stats[k]) != 0) {
+            errors++;
+            continue;
+        }
+        ls_list *list = S_ISDIR(operand_stats[k].stx_mode) && !opts.directory ? &dirs : &files;
+        if (add_ls_entry(list, operands[k]) != 0) {
+            errors++;
+            continue;
+        }
+        list->entries[list->count - 1].st = &operand_stats[k];
+    }
+    if (files.count > 1) {
+        qsort_r(files.entries, files.count, sizeof(ls_entry), compare_ls_entries, &opts);
+    }
+    if (dirs.count > 1) {
+        qsort_r(dirs.entries, dirs.count, sizeof(ls_entry), compare_ls_entries, &opts);
+    }
+
+    if (files.count > 0) {
+        print_ls_list(AT_FDCWD, &opts, &files, &dirs);
+    }
+    for (size_t k = 0; k < dirs.count; k++) {
+        if (operand_count > 1) {
+            out_printf(k > 0 || files.count > 0 ? "\n%s:\n" : "%s:\n", dirs.entries[k].name);
+        }
+        if (list_ls_directory(dirs.entries[k].name, &opts) != 0) {
+            errors++;
+        }
+    }
+    free(files.entries);
+    free(dirs.entries);
+    free(operand_stats);
+
+    if (errors > 0) {
+        out_printf("Invalid Command\n");
+        return 2;
+    }
+    return 0;
+}
+
+#define DD_CONV_NOTRUNC 1    // conv=notrunc: don't truncate the output file
+#define DD_CONV_NOCREAT 2    // conv=nocreat: the output file must exist
+#define DD_CONV_EXCL 4       // conv=excl: the output file must not exist
+#define DD_CONV_FSYNC 8      // conv=fsync: sync data and metadata before finishing
+#define DD_CONV_FDATASYNC 16 // conv=fdatasync: sync data before finishing
+#define DD_CONV_SYNC 32      // conv=sync: pad short input blocks with NULs
+#define DD_CONV_NOERROR 64   // conv=noerror: carry on after read errors
+#define DD_CONV_UCASE 128    // conv=ucase: upper-case the data
+#define DD_CONV_LCASE 256    // conv=lcase: lower-case the data
+
+// Bits of iflag= and oflag=, each the position of its name in the lists below
+#define DD_FLAG_DIRECT 1      // iflag/oflag=direct: bypass the page cache
+#define DD_FLAG_FULLBLOCK 2   // iflag=fullblock: keep reading until a block is full
+#define DD_FLAG_COUNT_BYTES 4 // iflag=count_bytes: count= is in bytes (also count=NB)
+#define DD_FLAG_SKIP_BYTES 8  // iflag=skip_bytes: skip= is in bytes (also skip=NB)
+#define DD_FLAG_SEEK_BYTES 2  // oflag=seek_bytes: seek= is in bytes (also seek=NB)
+
+const char *dd_conv_names[] = { "notrunc", "nocreat", "excl", "fsync", "fdatasync", "sync", "noerror", "ucase", "lcase", NULL };
+const char *dd_iflag_names[] = { "direct", "fullblock", "count_bytes", "skip_bytes", NULL };
+const char *dd_oflag_names[] = { "direct", "seek_bytes", NULL };
+
+// Operands of one 'dd' run
+typedef struct {
+    const char *input;        // if=, or NULL for stdin
+    const char *output;       // of=, or NULL for stdout
+    size_t ibs;               // Bytes per input block
+    size_t obs;               // Bytes per output block
+    unsigned long long count; // Input blocks to copy; ULLONG_MAX for all
+    unsigned long long limit; // Input bytes to copy when count is in bytes; ULLONG_MAX for all
+    unsigned long long skip;  // Input skipped before copying, in blocks until parsed, then bytes
+    unsigned long long seek;  // Output skipped before copying, in blocks until parsed, then bytes
+    int conv;                 // DD_CONV_* bits
+    int iflags;               // DD_FLAG_* bits for the input
+    int oflags;               // DD_FLAG_* bits for the output
+    int quiet;                // status=none: no statistics
+    int noxfer;               // status=noxfer: no transfer line
+} dd_options;
+
+// What a 'dd' run moved, for its report
+typedef struct {
+    unsigned long long in_full;     // Whole input blocks read
+    unsigned long long in_partial;  // Short input blocks read
+    unsigned long long out_full;    // Whole output blocks written
+    unsigned long long out_partial; // Short output blocks written
+    unsigned long long bytes;       // Bytes written
+} dd_stats;
+
+// Parse a dd number: digits and an optional multiplier suffix as GNU dd takes
+// them (c, w, b, kB, K, KiB, MB, M, MiB, ...). *bytes is set when the suffix
+// ends in B, which makes count, skip and seek count bytes rather than blocks.
+// Returns 0, or -1 if malformed.
+int parse_dd_number(const char *text, unsigned long long *value, int *bytes) {
+    char *end;
+    errno = 0;
+    if (*text < '0' || *text > '9') {
+        return -1;
+    }
+    unsigned long long number = strtoull(text, &end, 10);
+    if (errno != 0) {
+        return -1;
+    }
+    unsigned long long multiplier = 1;
+    if (*end != '\0') {
+        const char *letters = "KMGTPE";
+        const char *unit = strchr(letters, end[0] == 'k' ? 'K' : end[0]);
+        if (end[0] == 'c' && end[1] == '\0') {
+            multiplier = 1;
+        } else if (end[0] == 'w' && end[1] == '\0') {
+            multiplier = 2;
+        } else if (end[0] == 'b' && end[1] == '\0') {
+            multiplier = 512;
+        } else if (unit != NULL && *unit != '\0') {
+            unsigned long long base;
+            if (end[1] == '\0' || strcmp(end + 1, "iB") == 0) {
+                base = 1024;
+            } else if (strcmp(end + 1, "B") == 0) {
+                base = 1000;
+            } else {
+                return -1;
+            }
+            for (const char *p = letters; p <= unit; p++) {
+                multiplier *= base;
+            }
+        } else {
+            return -1;
+        }
+    }
+    if (multiplier != 0 && number > ULLONG_MAX / multiplier) {
+        return -1;
+    }
+    *value = number * multiplier;
+    *bytes = *end != '\0' && end[strlen(end) - 1] == 'B';
+    return 0;
+}
+
+// Turn a comma-separated list of names into bits, the bit of names[i] being
+// 1 << i. Returns 0, or -1 on a name not in the list.
+int parse_dd_flags(const char *list, const char **names, int *bits) {
+    while (*list != '\0') {
+        size_t len = strcspn(list, ",");
+        int i = 0;
+        while (names[i] != NULL && (strlen(names[i]) != len || strncmp(names[i], list, len) != 0)) {
+            i++;
+        }
+        if (names[i] == NULL) {
+            return -1;
+        }
+        *bits |= 1 << i;
+        list += len + (list[len] == ',');
+    }
+    return 0;
+}
+
+// Amount as dd reports it: scaled to the largest unit under 1000 (or 1024),
+// one decimal below ten and none above, e.g. "1.0 MB", "98 KiB", "557 MB"
+void format_dd_amount(double amount, int iec, char *buf, size_t len) {
+    double base = iec ? 1024 : 1000;
+    int exponent = 0;
+    while (amount >= base && exponent < 6) {
+        amount /= base;
+        exponent++;
+    }
+    if (amount >= 10 && (unsigned long long)(amount + 0.5) >= base && exponent < 6) {
+        amount /= base; // Rounds up into the next unit
+        exponent++;
+    }
+    char prefix[4] = "";
+    if (exponent > 0) {
+        snprintf(prefix, sizeof(prefix), "%c%s", (iec ? "KMGTPE" : "kMGTPE")[exponent - 1], iec ? "i" : "");
+    }
+    if (amount < 10) {
+        snprintf(buf, len, "%.1f %sB", amount, prefix);
+    } else {
+        snprintf(buf, len, "%.0f %sB", amount, prefix);
+    }
+}
+
+// Print the record counts and, unless status= asked otherwise, the transfer line
+void print_dd_stats(dd_options *opts, dd_stats *stats, double seconds) {
+    if (opts->quiet) {
+        return;
+    }
+    err_printf("%llu+%llu records in\n%llu+%llu records out\n",
+            stats->in_full, stats->in_partial, stats->out_full, stats->out_partial);
+    if (opts->noxfer) {
+        return;
+    }
+    char si[32], iec[32], rate[32];
+    format_dd_amount(stats->bytes, 0, si, sizeof(si));
+    format_dd_amount(stats->bytes, 1, iec, sizeof(iec));
+    if (seconds > 0) {
+        format_dd_amount(stats->bytes / seconds, 0, rate, sizeof(rate));
+    } else {
+        snprintf(rate, sizeof(rate), "Infinity B");
+    }
+    if (stats->bytes == 1) {
+        err_printf("1 byte copied");
+    } else if (stats->bytes < 1000) {
+        err_printf("%llu bytes copied", stats->bytes);
+    } else if (stats->bytes < 1024) {
+        err_printf("%llu bytes (%s) copied", stats->bytes, si);
+    } else {
+        err_printf("%llu bytes (%s, %s) copied", stats->bytes, si, iec);
+    }
+    err_printf(", %g s, %s/s\n", seconds, rate);
+}
+
+// Read one input block of up to size bytes; with iflag=fullblock keep reading
+// until it is full or the input ends. Returns the bytes read, or -1 on an error.
+ssize_t read_dd_block(dd_options *opts, int fd, char *buf, size_t size) {
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = read(fd, buf + got, size - got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return got > 0 ? (ssize_t)got : -1;
+        }
+        got += n;
+        if (n == 0 || !(opts->iflags & DD_FLAG_FULLBLOCK)) {
+            break;
+        }
+    }
+    return got;
+}
+
+// Write one output block, counting it; errors are reported. O_DIRECT can't write a short final block,
+// so it is turned off for that one, as GNU dd does.
+int write_dd_block(dd_options *opts, dd_stats *stats, int fd, const char *buf, size_t len) {
+    if ((opts->oflags & DD_FLAG_DIRECT) && opts->output != NULL && len % DD_DIRECT_ALIGN != 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+    }
+    if (write_all(fd, buf, len) != 0) {
+        err_printf("dd: error writing '%s': %s\n", opts->output ? opts->output : "standard output", strerror(errno));
+        return -1;
+    }
+    if (len == opts->obs) {
+        stats->out_full++;
+    } else {
+        stats->out_partial++;
+    }
+    stats->bytes += len;
+    return 0;
+}
+
+// Copy between two regular files with copy_file_range, so the data never
+// leaves the kernel (and reflinks on filesystems that share extents).
+// Returns 0, -1 on an error, or 1 if the kernel can't do it for these files.
+int copy_dd_range(dd_options *opts, dd_stats *stats, int in_fd, int out_fd) {
+    unsigned long long limit = opts->limit;
+    if (opts->count != ULLONG_MAX) {
+        limit = opts->count > ULLONG_MAX / opts->ibs ? ULLONG_MAX : opts->count * opts->ibs;
+    }
+    unsigned long long copied = 0;
+    while (copied < limit) {
+        size_t want = limit - copied < CAT_CHUNK_SIZE ? limit - copied : CAT_CHUNK_SIZE;
+        ssize_t n = copy_file_range(in_fd, NULL, out_fd, NULL, want, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            if (copied == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)) {
+                return 1;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        copied += n;
+    }
+    // Reads of a regular file come back full, so the records follow from the size
+    stats->in_full = stats->out_full = copied / opts->ibs;
+    stats->in_partial = stats->out_partial = copied % opts->ibs != 0;
+    stats->bytes = copied;
+    return 0;
+}
+
+// Copy block by block through a buffer aligned for O_DIRECT, applying conv=
+// and regrouping into obs-sized blocks when ibs and obs differ. Returns 0, or
+// -1 on an error (reported).
+int copy_dd_blocks(dd_options *opts, dd_stats *stats, int in_fd, int out_fd) {
+    int reblock = opts->ibs != opts->obs;
+    char *in_buf = NULL;
+    char *out_buf = NULL;
+    if (posix_memalign((void **)&in_buf, DD_DIRECT_ALIGN, opts->ibs) != 0
+        || (reblock && posix_memalign((void **)&out_buf, DD_DIRECT_ALIGN, opts->obs) != 0)) {
+        free(in_buf);
+        err_printf("dd: memory exhausted\n");
+        return -1;
+    }
+    size_t pending = 0; // Bytes waiting in out_buf
+    unsigned long long remaining = opts->limit;
+    int result = 0;
+    for (unsigned long long blocks = 0; (opts->count == ULLONG_MAX || blocks < opts->count) && remaining > 0; blocks++) {
+        ssize_t n = read_dd_block(opts, in_fd, in_buf, remaining < opts->ibs ? remaining : opts->ibs);
+        if (n < 0) {
+            err_printf("dd: error reading '%s': %s\n", opts->input ? opts->input : "standard input", strerror(errno));
+            if (!(opts->conv & DD_CONV_NOERROR)) {
+                result = -1;
+                break;
+            }
+            lseek(in_fd, opts->ibs, SEEK_CUR); // Step over the bad block where the input allows it
+            if (!(opts->conv & DD_CONV_SYNC)) {
+                continue;
+            }
+            n = 0;
+        } else if (n == 0) {
+            break;
+        }
+        if (remaining != ULLONG_MAX) {
+            remaining -= n;
+        }
+        if ((size_t)n == opts->ibs) {
+            stats->in_full++;
+        } else {
+            stats->in_partial++;
+        }
+        if ((opts->conv & DD_CONV_SYNC) && (size_t)n < opts->ibs) {
+            memset(in_buf + n, 0, opts->ibs - n);
+            n = opts->ibs;
+        }
+        if (opts->conv & (DD_CONV_UCASE | DD_CONV_LCASE)) {
+            for (ssize_t i = 0; i < n; i++) {
+                in_buf[i] = (opts->conv & DD_CONV_UCASE) ? toupper((unsigned char)in_buf[i]) : tolower((unsigned char)in_buf[i]);
+            }
+        }
+
+        if (!reblock) {
+            if (write_dd_block(opts, stats, out_fd, in_buf, n) != 0) {
+                result = -1;
+                break;
+            }
+            continue;
+        }
+        for (ssize_t used = 0; used < n && result == 0;) {
+            size_t take = (size_t)(n - used) < opts->obs - pending ? (size_t)(n - used) : opts->obs - pending;
+            memcpy(out_buf + pending, in_buf + used, take);
+            pending += take;
+            used += take;
+            if (pending == opts->obs) {
+                result = write_dd_block(opts, stats, out_fd, out_buf, pending);
+                pending = 0;
+            }
+        }
+        if (result != 0) {
+            break;
+        }
+    }
+    if (result == 0 && pending > 0) {
+        result = write_dd_block(opts, stats, out_fd, out_buf, pending);
+    }
+    free(in_buf);
+    free(out_buf);
+    return result;
+}
+
+// Skip the start of the input: seek past it, or read it away from a pipe.
+// Returns 0, or -1 on an error.
+int skip_dd_input(dd_options *opts, int fd) {
+    if (opts->skip == 0) {
+        return 0;
+    }
+    if (opts->skip <= LLONG_MAX && lseek(fd, opts->skip, SEEK_CUR) != -1) {
+        return 0;
+    }
+    char *buf = malloc(opts->ibs);
+    if (buf == NULL) {
+        return -1;
+    }
+    unsigned long long skipped = 0;
+    while (skipped < opts->skip) {
+        ssize_t n = read_dd_block(opts, fd, buf, opts->skip - skipped < opts->ibs ? opts->skip - skipped : opts->ibs);
+        if (n <= 0) {
+            break; // Skipping past the end leaves nothing to copy, as in dd
+        }
+        skipped += n;
+    }
+    free(buf);
+    return 0;
+}
+
+// Run the system dd for operands the builtin doesn't implement; returns its exit status
+int dd_with_system(char **args) {
+    pid_t pid = launch_command(args, STDIN_FILENO, STDOUT_FILENO, NULL, 0, -1);
+    if (pid <= 0) {
+        out_printf("Invalid Command\n");
+        return 127;
+    }
+    int wait_status = 0;
+    while (waitpid(pid, &wait_status, 0) == -1 && errno == EINTR) {
+    }
+    int status = exit_status(wait_status);
+    if (status != 0) {
+        out_printf("Invalid Command\n");
+    }
+    return status;
+}
+
+// Handle 'dd [operand=value ...]' without starting a process: if, of, bs, ibs,
+// obs, count, skip, seek, conv, iflag, oflag and status. Regular files are
+// copied with copy_file_range; everything else goes block by block. The
+// record counts and transfer rate go to stderr in GNU dd's format.
+int dd_command(char **args) {
+    dd_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.ibs = opts.obs = DD_BLOCK_SIZE;
+    opts.count = ULLONG_MAX;
+    opts.limit = ULLONG_MAX;
+
+    for (int i = 1; args[i] != NULL; i++) {
+        char *value = strchr(args[i], '=');
+        if (value == NULL) {
+            out_printf("Invalid Command\n");
+            return 1;
+        }
+        size_t name_len = value - args[i];
+        value++;
+        unsigned long long number = 0;
+        int bytes = 0;
+        int numeric = parse_dd_number(value, &number, &bytes) == 0;
+        int ok = 1;
+        if (name_len == 2 && strncmp(args[i], "if", 2) == 0) {
+            opts.input = value;
+        } else if (name_len == 2 && strncmp(args[i], "of", 2) == 0) {
+            opts.output = value;
+        } else if (name_len == 2 && strncmp(args[i], "bs", 2) == 0) {
+            ok = numeric && number > 0 && number <= SSIZE_MAX;
+            opts.ibs = opts.obs = number;
+        } else if (name_len == 3 && strncmp(args[i], "ibs", 3) == 0) {
+            ok = numeric && number > 0 && number <= SSIZE_MAX;
+            opts.ibs = number;
+        } else if (name_len == 3 && strncmp(args[i], "obs", 3) == 0) {
+            ok = numeric && number > 0 && number <= SSIZE_MAX;
+            opts.obs = number;
+        } else if (name_len == 5 && strncmp(args[i], "count", 5) == 0) {
+            ok = numeric;
+            opts.count = number;
+            opts.iflags |= bytes ? DD_FLAG_COUNT_BYTES : 0;
+        } else if (name_len == 4 && strncmp(args[i], "skip", 4) == 0) {
+            ok = numeric;
+            opts.skip = number;
+            opts.iflags |= bytes ? DD_FLAG_SKIP_BYTES : 0;
+        } else if (name_len == 4 && strncmp(args[i], "seek", 4) == 0) {
+            ok = numeric;
+            opts.seek = number;
+            opts.oflags |= bytes ? DD_FLAG_SEEK_BYTES : 0;
+        } else if (name_len == 4 && strncmp(args[i], "conv", 4) == 0) {
+            ok = parse_dd_flags(value, dd_conv_names, &opts.conv) == 0;
+        } else if (name_len == 5 && strncmp(args[i], "iflag", 5) == 0) {
+            ok = parse_dd_flags(value, dd_iflag_names, &opts.iflags) == 0;
+        } else if (name_len == 5 && strncmp(args[i], "oflag", 5) == 0) {
+            ok = parse_dd_flags(value, dd_oflag_names, &opts.oflags) == 0;
+        } else if (name_len == 6 && strncmp(args[i], "status", 6) == 0) {
+            opts.quiet = strcmp(value, "none") == 0;
+            opts.noxfer = strcmp(value, "noxfer") == 0;
+            ok = opts.quiet || opts.noxfer;
+        } else {
+            ok = 0;
+        }
+        if (!ok) {
+            return dd_with_system(args); // Operands, flags and conversions the builtin lacks
+        }
+    }
+    if ((opts.conv & DD_CONV_EXCL) && (opts.conv & DD_CONV_NOCREAT)) {
+        out_printf("Invalid Command\n");
+        return 1;
+    }
+    // From here on skip and seek are in bytes, and a count in bytes is a limit
+    if ((opts.iflags & DD_FLAG_COUNT_BYTES) && opts.count != ULLONG_MAX) {
+        opts.limit = opts.count;
+        opts.count = ULLONG_MAX;
+    }
+    if (!(opts.iflags & DD_FLAG_SKIP_BYTES)) {
+        opts.skip = opts.skip > ULLONG_MAX / opts.ibs ? ULLONG_MAX : opts.skip * opts.ibs;
+    }
+    if (!(opts.oflags & DD_FLAG_SEEK_BYTES)) {
+        opts.seek = opts.seek > ULLONG_MAX / opts.obs ? ULLONG_MAX : opts.seek * opts.obs;
+    }
+
+    flush_output(); // dd writes to the descriptor directly
+    int in_fd = STDIN_FILENO;
+    int out_fd = STDOUT_FILENO;
+    // O_DIRECT only applies to files named by if= and of=: setting it on stdin
+    // or stdout would change the shell's own descriptors
+    int direct_in = (opts.iflags & DD_FLAG_DIRECT) && opts.input != NULL ? O_DIRECT : 0;
+    int direct_out = (opts.oflags & DD_FLAG_DIRECT) && opts.output != NULL ? O_DIRECT : 0;
+    if (opts.input != NULL) {
+        in_fd = open(opts.input, O_RDONLY | O_CLOEXEC | direct_in);
+    }
+    if (in_fd == -1) {
+        err_printf("dd: failed to open '%s': %s\n", opts.input, strerror(errno));
+        out_printf("Invalid Command\n");
+        return 1;
+    }
+    if (opts.output != NULL) {
+        int flags = O_WRONLY | O_CLOEXEC | direct_out;
+        flags |= (opts.conv & DD_CONV_NOCREAT) ? 0 : O_CREAT;
+        flags |= (opts.conv & DD_CONV_EXCL) ? O_EXCL : 0;
+        out_fd = open(opts.output, flags, 0666);
+    }
+    if (out_fd == -1) {
+        err_printf("dd: failed to open '%s': %s\n", opts.output, strerror(errno));
+        if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
+        out_printf("Invalid Command\n");
+        return 1;
+    }
+
+    // Position both ends; an output file is cut at the seek point unless conv=notrunc
+    int failed = skip_dd_input(&opts, in_fd) != 0;
+    struct stat in_st, out_st;
+    int regular_out = fstat(out_fd, &out_st) == 0 && S_ISREG(out_st.st_mode);
+    if (!failed && opts.seek > 0 && (opts.seek > LLONG_MAX || lseek(out_fd, opts.seek, SEEK_CUR) == -1)) {
+        err_printf("dd: cannot seek '%s': %s\n", opts.output ? opts.output : "standard output", strerror(errno));
+        failed = 1;
+    }
+    if (!failed && opts.output != NULL && regular_out && !(opts.conv & DD_CONV_NOTRUNC)
+        && ftruncate(out_fd, opts.seek) != 0) {
+        err_printf("dd: failed to truncate '%s': %s\n", opts.output, strerror(errno));
+        failed = 1;
+    }
+
+    dd_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!failed) {
+        int copied = 1;
+        int plain = opts.ibs == opts.obs && !(opts.conv & (DD_CONV_SYNC | DD_CONV_NOERROR | DD_CONV_UCASE | DD_CONV_LCASE))
+                    && !direct_in && !direct_out;
+        if (plain && regular_out && fstat(in_fd, &in_st) == 0 && S_ISREG(in_st.st_mode)) {
+            copied = copy_dd_range(&opts, &stats, in_fd, out_fd);
+            if (copied < 0) {
+                err_printf("dd: error copying '%s': %s\n", opts.input ? opts.input : "standard input", strerror(errno));
+            }
+        }
+        if (copied > 0) {
+            copied = copy_dd_blocks(&opts, &stats, in_fd, out_fd);
+        }
+        failed = copied != 0;
+    }
+    if (!failed && (opts.conv & (DD_CONV_FSYNC | DD_CONV_FDATASYNC))
+        && ((opts.conv & DD_CONV_FSYNC) ? fsync(out_fd) : fdatasync(out_fd)) != 0) {
+        err_printf("dd: fsync failed for '%s': %s\n", opts.output ? opts.output : "standard output", strerror(errno));
+        failed = 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    print_dd_stats(&opts, &stats, elapsed_seconds(&start, &end));
+
+    if (in_fd != STDIN_FILENO) {
+        close(in_fd);
+    }
+    if (out_fd != STDOUT_FILENO && close(out_fd) != 0) {
+        failed = 1;
+    }
+    if (failed) {
+        out_printf("Invalid Command\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Measures 'stats' keeps a histogram of
+typedef enum {
+    STATS_WALL,     // Wall-clock time of a pipeline, in microseconds
+    STATS_CPU,      // User plus system time of its stages, in microseconds
+    STATS_RSS,      // Largest max RSS among its stages, in KB
+    STATS_OVERHEAD, // The shell's parse and spawn time, in microseconds
+    STATS_KINDS
+} stats_kind;
+
+// Counts of one measure in power-of-two buckets: bucket 0 holds 0, bucket b
+// holds [2^(b-1), 2^b), and the last one everything above
+typedef struct {
+    const char *title;
+    int in_kb;                           // Values are sizes in KB rather than microseconds
+    unsigned long counts[STATS_BUCKETS];
+    unsigned long samples;
+    double sum;
+    double max;
+} stats_histogram;
+
+stats_histogram stats_histograms[STATS_KINDS] = {
+    { "wall time", 0, {0}, 0, 0, 0 },
+    { "cpu time", 0, {0}, 0, 0, 0 },
+    { "max RSS", 1, {0}, 0, 0, 0 },
+    { "shell overhead", 0, {0}, 0, 0, 0 }
+};
+
+// Totals over every measured pipeline
+typedef struct {
+    unsigned long pipelines;
+    unsigned long stages;
+    unsigned long long major_faults;
+    unsigned long long minor_faults;
+    unsigned long long voluntary_switches;
+    unsigned long long involuntary_switches;
+} stats_totals;
+
+stats_totals stats_total;
+
+void add_stats_sample(stats_kind kind, double value) {
+    stats_histogram *h = &stats_histograms[kind];
+    unsigned long long whole = value;
+    int bucket = whole == 0 ? 0 : 64 - __builtin_clzll(whole);
+    h->counts[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1]++;
+    h->samples++;
+    h->sum += value;
+    h->max = value > h->max ? value : h->max;
+}
+
+// Add a measured pipeline to the 'stats' histograms
+void record_stats(pipeline_metrics *metrics, struct rusage *total, double wall) {
+    stats_total.pipelines++;
+    stats_total.stages += metrics->stage_count;
+    stats_total.major_faults += total->ru_majflt;
+    stats_total.minor_faults += total->ru_minflt;
+    stats_total.voluntary_switches += total->ru_nvcsw;
+    stats_total.involuntary_switches += total->ru_nivcsw;
+    add_stats_sample(STATS_WALL, wall * 1e6);
+    add_stats_sample(STATS_CPU, (timeval_seconds(&total->ru_utime) + timeval_seconds(&total->ru_stime)) * 1e6);
+    add_stats_sample(STATS_RSS, total->ru_maxrss);
+    add_stats_sample(STATS_OVERHEAD, (metrics->parse_seconds + metrics->spawn_seconds) * 1e6);
+}
+
+// A histogram value with a readable unit: 750us, 1.5ms, 2s / 512K, 1.5M
+void format_stats_value(double value, int in_kb, char *buf, size_t len) {
+    if (in_kb) {
+        if (value < 1024) {
+            snprintf(buf, len, "%.0fK", value);
+        } else if (value < 1024 * 1024) {
+            snprintf(buf, len, "%.3gM", value / 1024);
+        } else {
+            snprintf(buf, len, "%.3gG", value / (1024 * 1024));
+        }
+    } else if (value < 1000) {
+        snprintf(buf, len, "%.0fus", value);
+    } else if (value < 1e6) {
+        snprintf(buf, len, "%.3gms", value / 1e3);
+    } else {
+        snprintf(buf, len, "%.3gs", value / 1e6);
+    }
+}
+
+void print_stats_histogram(stats_histogram *h) {
+    char mean[32], max[32];
+    format_stats_value(h->samples > 0 ? h->sum / h->samples : 0, h->in_kb, mean, sizeof(mean));
+    format_stats_value(h->max, h->in_kb, max, sizeof(max));
+    out_printf("%s: mean %s, max %s\n", h->title, mean, max);
+    unsigned long most = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        most = h->counts[b] > most ? h->counts[b] : most;
+    }
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        if (h->counts[b] == 0) {
+            continue;
+        }
+        char low[32], high[32];
+        format_stats_value(b == 0 ? 0 : (double)(1ULL << (b - 1)), h->in_kb, low, sizeof(low));
+        format_stats_value((double)(1ULL << b), h->in_kb, high, sizeof(high));
+        int bar = (int)((h->counts[b] * 40 + most - 1) / most);
+        out_printf("  %8s .. %-8s %8lu ", low, b == STATS_BUCKETS - 1 ? "" : high, h->counts[b]);
+        for (int i = 0; i < bar; i++) {
+            out_putc('#');
+        }
+        out_putc('\n');
+    }
+}
+
+// Handle 'stats [on|off|reset]': with no argument, print the histograms of every
+// pipeline measured so far, by 'time' or while 'stats on' measures them all
+int stats_command(char **args) {
+    if (args[1] != NULL && args[2] == NULL && strcmp(args[1], "on") == 0) {
+        stats_enabled = 1;
+        return 0;
+    }
+    if (args[1] != NULL && args[2] == NULL && strcmp(args[1], "off") == 0) {
+        stats_enabled = 0;
+        return 0;
+    }
+    if (args[1] != NULL && args[2] == NULL && strcmp(args[1], "reset") == 0) {
+        memset(&stats_total, 0, sizeof(stats_total));
+        for (int k = 0; k < STATS_KINDS; k++) {
+            memset(stats_histograms[k].counts, 0, sizeof(stats_histograms[k].counts));
+            stats_histograms[k].samples = 0;
+            stats_histograms[k].sum = 0;
+            stats_histograms[k].max = 0;
+        }
+        return 0;
+    }
+    if (args[1] != NULL) {
+        out_printf("Invalid Command\n");
+        return 1;
+    }
+    out_printf("%lu pipelines, %lu stages (measuring %s)\n", stats_total.pipelines, stats_total.stages,
+           stats_enabled ? "every command" : "'time' only");
+    out_printf("page faults: %llu major, %llu minor; context switches: %llu voluntary, %llu involuntary\n",
+           stats_total.major_faults, stats_total.minor_faults,
+           stats_total.voluntary_switches, stats_total.involuntary_switches);
+    if (stats_total.pipelines > 0) {
+        for (int k = 0; k < STATS_KINDS; k++) {
+            print_stats_histogram(&stats_histograms[k]);
+        }
+    }
+    return 0;
+}
+
+// Handle 'set -o [option]' and 'set +o [option]'. The only option is trace,
+// which traces the shell to $TRACEFILE (or DEFAULT_TRACEFILE) until turned off.
+// Without an option, -o lists the settings and +o prints commands restoring them.
+int set_command(char **args) {
+    if (args[1] == NULL || (strcmp(args[1], "-o") != 0 && strcmp(args[1], "+o") != 0)
+        || (args[2] != NULL && (strcmp(args[2], "trace") != 0 || args[3] != NULL))) {
+        out_printf("Invalid Command\n");
+        return 2;
+    }
+    int on = args[1][0] == '-';
+    if (args[2] == NULL) {
+        if (on) {
+            out_printf("trace\t%s\n", trace_fd != -1 ? "on" : "off");
+        } else {
+            out_printf("set %co trace\n", trace_fd != -1 ? '-' : '+');
+        }
+        return 0;
+    }
+    if (!on) {
+        stop_trace();
+        return 0;
+    }
+    const char *path = get_variable("TRACEFILE");
+    if (start_trace(path != NULL && *path != '\0' ? path : DEFAULT_TRACEFILE) != 0) {
+        out_printf("Invalid Command\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Print a 'time' report in a TIMEFORMAT format. As in bash, %[p][l]R, U and S
+// are real, user and system seconds (p decimals, l for MmS.FFFs) and %P is the
+// CPU percentage. Also %M max RSS in KB, %F and %r major and minor page faults,
+// %w and %c voluntary and involuntary context switches, and \n and \t.
+void print_time_format(const char *format, double real, struct rusage *usage) {
+    double user = timeval_seconds(&usage->ru_utime);
+    double sys = timeval_seconds(&usage->ru_stime);
+    for (const char *p = format; *p != '\0'; p++) {
+        if (*p == '\\' && (p[1] == 'n' || p[1] == 't')) {
+            err_putc(*++p == 'n' ? '\n' : '\t');
+            continue;
+        }
+        if (*p != '%') {
+            err_putc(*p);
+            continue;
+        }
+        const char *start = p++;
+        int precision = 3;
+        int minutes = 0;
+        if (*p >= '0' && *p <= '9') {
+            precision = *p++ - '0';
+            precision = precision > 3 ? 3 : precision;
+        }
+        if (*p == 'l') {
+            minutes = 1;
+            p++;
+        }
+        double seconds;
+        switch (*p) {
+        case 'R':
+            seconds = real;
+            break;
+        case 'U':
+            seconds = user;
+            break;
+        case 'S':
+            seconds = sys;
+            break;
+        case 'P':
+            err_printf("%.2f", real > 0 ? (user + sys) * 100 / real : 0);
+            continue;
+        case 'M':
+            err_printf("%ld", usage->ru_maxrss);
+            continue;
+        case 'F':
+            err_printf("%ld", usage->ru_majflt);
+            continue;
+        case 'r':
+            err_printf("%ld", usage->ru_minflt);
+            continue;
+        case 'w':
+            err_printf("%ld", usage->ru_nvcsw);
+            continue;
+        case 'c':
+            err_printf("%ld", usage->ru_nivcsw);
+            continue;
+        case '%':
+            err_putc('%');
+            continue;
+        default:
+            // Not a conversion: print it as written
+            err_write(start, p - start + (*p != '\0'));
+            if (*p == '\0') {
+                p--;
+            }
+            continue;
+        }
+        if (minutes) {
+            long whole_minutes = (long)(seconds / 60);
+            err_printf("%ldm%.*fs", whole_minutes, precision, seconds - whole_minutes * 60);
+        } else {
+            err_printf("%.*f", precision, seconds);
+        }
+    }
+    err_putc('\n');
+}
+
+// Report what a timed pipeline cost on stderr. Without TIMEFORMAT this is
+// bash's report followed by each stage's usage and the shell's own overhead.
+void print_time_report(command_node *node, pipeline_metrics *metrics, struct rusage *total, double real) {
+    flush_output(); // Keep buffered output ahead of the report
+    if (node->timed == TIME_POSIX) {
+        err_printf("real %.2f\nuser %.2f\nsys %.2f\n", real,
+                timeval_seconds(&total->ru_utime), timeval_seconds(&total->ru_stime));
+        return;
+    }
+    const char *format = get_variable("TIMEFORMAT");
+    if (format != NULL) {
+        if (*format != '\0') {
+            print_time_format(format, real, total);
+        }
+        return;
+    }
+    print_time_format(DEFAULT_TIMEFORMAT, real, total);
+    command_node **stages = node->type == NODE_PIPELINE ? node->stages : &node;
+    for (int i = 0; i < metrics->stage_count; i++) {
+        char description[256] = "";
+        int timed = stages[i]->timed;
+        stages[i]->timed = 0; // The stage alone, without the keyword
+        describe_node(stages[i], description, sizeof(description));
+        stages[i]->timed = timed;
+        struct rusage *u = &metrics->usage[i];
+        err_printf("[%d] %s%s: user %.3fs sys %.3fs, max RSS %ld KB, faults %ld major %ld minor, "
+                "switches %ld voluntary %ld involuntary\n", i + 1, description,
+                metrics->pids[i] == 0 ? " (in shell)" : "", timeval_seconds(&u->ru_utime),
+                timeval_seconds(&u->ru_stime), u->ru_maxrss, u->ru_majflt, u->ru_minflt, u->ru_nvcsw, u->ru_nivcsw);
+    }
+    err_printf("shell: parse %.6fs, spawn %.6fs\n", metrics->parse_seconds, metrics->spawn_seconds);
+}
+
+// A command the shell runs itself. The handler reads and writes fds 0 and 1,
+// which the caller points at the pipe, a redirection or a buffer beforehand.
+typedef int (*builtin_handler)(char **args);
+
+#define BUILTIN_IN_PROCESS 1     // May run inside the shell process; otherwise it is always forked
+#define BUILTIN_PIPELINE_SAFE 2  // Short output and no stdin: may run in the shell before later stages
+#define BUILTIN_READS_STDIN 4    // Needs stdin wired up; under job control one on a pipe or the terminal gets its own process
+#define BUILTIN_CHANGES_SHELL 8  // Changes the shell's own state, so $( ) runs it in a child shell
+#define BUILTIN_WAITS_ON_RUNS 16 // Starts processes and waits on them; under job control it is forked so Ctrl-Z stops it too
+
+typedef struct {
+    const char *name;        // Command name, NULL for an empty slot
+    builtin_handler handler; // Runs it; returns its exit status
+    int flags;               // BUILTIN_* bits
+} builtin;
+
+// Builtins are found with a perfect hash in the style of gperf: a name's slot is
+// its length plus the association values of its first and last letters. The
+// values were searched for offline so every builtin gets a slot of its own; when
+// adding one, pick new values that keep the slots distinct. A clash shows up at
+// compile time as an overwritten initializer (-Wextra).
+#define BUILTIN_SLOTS 30
+
+unsigned char builtin_asso[26] = {
+    BUILTIN_SLOTS, 12, 22, 1, 8, 11, 6, 4, BUILTIN_SLOTS, 19, 5, 12, BUILTIN_SLOTS,
+    BUILTIN_SLOTS, BUILTIN_SLOTS, 3, BUILTIN_SLOTS, BUILTIN_SLOTS, 1, 4, 0, BUILTIN_SLOTS, 3, BUILTIN_SLOTS, 17, BUILTIN_SLOTS
+};
+
+builtin builtins[BUILTIN_SLOTS] = {
+    [4] = { "dd", dd_command, BUILTIN_IN_PROCESS | BUILTIN_READS_STDIN },
+    [7] = { "stats", stats_command, BUILTIN_IN_PROCESS | BUILTIN_PIPELINE_SAFE },
+    [8] = { "set", set_command, BUILTIN_IN_PROCESS | BUILTIN_PIPELINE_SAFE | BUILTIN_CHANGES_SHELL },
+    [9] = { "unset", unset_command, BUILTIN_IN_PROCESS | BUILTIN_PIPELINE_SAFE | BUILTIN_CHANGES_SHELL },
+    [11] = { "wait", wait_command, BUILTIN_IN_PROCESS | BUILTIN_PIPELINE_SAFE | BUILTIN_CHANGES_SHELL },
+    [12] = { "hash", hash_command, BUILTIN_IN_PROCESS | BUILTIN_PIPELINE_SAFE },
+    [13] = { "grep", grep_command, BUILTIN_IN_PROCESS | BUILTIN_READS_STDIN },
+    [15] = { "ls", ls_command, BUILTIN_IN_PROCESS },
+    [16] = { "exit", exit_command, BUILTIN_IN_PROCESS | BUILTIN_CHANGES_SHELL },
+    [18] = { "export", export_command, BUILTIN_IN_PROCESS | BUILTIN_PIPELINE_SAFE | BUILTIN_CHANGES_SHELL },
+    [19] = { "fg", fg_command, BUILTIN_IN_PROCESS | BUILTIN_PIPELINE_SAFE | BUILTIN_CHANGES_SHELL },
+    [20] = { "bg", bg_command, BUILTIN_IN_PROCESS | BUILTIN_PIPELINE_SAFE | BUILTIN_CHANGES_SHELL },
+    [21] = { "kill", kill_command, BUILTIN_IN_PROCESS | BUILTIN_PIPELINE_SAFE },
+    [23] = { "parallel", parallel_command, BUILTIN_IN_PROCESS | BUILTIN_WAITS_ON_RUNS },
+    [24] = { "jobs", jobs_command, BUILTIN_IN_PROCESS | BUILTIN_PIPELINE_SAFE },
+    [25] = { "cd", cd_command, BUILTIN_IN_PROCESS | BUILTIN_PIPELINE_SAFE | BUILTIN_CHANGES_SHELL },
+    [28] = { "history", history_command, BUILTIN_IN_PROCESS | BUILTIN_PIPELINE_SAFE },
+    [29] = { "cat", cat_command, BUILTIN_IN_PROCESS | BUILTIN_READS_STDIN }
+};
+
+// Look up a builtin by name; NULL if there is none
+const builtin *find_builtin(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0) {
+        return NULL;
+    }
+    unsigned int first = (unsigned char)name[0] - 'a';
+    unsigned int last = (unsigned char)name[len - 1] - 'a';
+    if (first >= 26 || last >= 26) {
+        return NULL; // Every builtin starts and ends with a lowercase letter
+    }
+    size_t slot = len + builtin_asso[first] + builtin_asso[last];
+    if (slot >= BUILTIN_SLOTS || builtins[slot].name == NULL || strcmp(builtins[slot].name, name) != 0) {
+        return NULL;
+    }
+    return &builtins[slot];
+}
+
+// The builtin a stage runs, or NULL for a subshell or an external command
+const builtin *stage_builtin(command_node *node) {
+    return node->type == NODE_COMMAND ? find_builtin(node->argv[0]) : NULL;
+}
+
+// Whether one of a stage's own redirections replaces the given descriptor
+int stage_redirects(command_node *node, int fd) {
+    for (int i = 0; i < node->redirect_count; i++) {
+        if (node->redirects[i].fd == fd) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Run a pipeline stage that must live in a forked child (a subshell, or a builtin
+// writing into a pipe) with stdin/stdout already in place; returns its exit status
+int run_forked_stage(command_node *node) {
+    if (node->type == NODE_SUBSHELL) {
+        return execute_node(node->left);
+    }
+    return stage_builtin(node)->handler(node->argv);
+}
+
+// Run a builtin in the shell itself, its stdin/stdout (unless already 0/1) and
+// redirections standing in for the shell's own descriptors while it runs;
+// returns its exit status
+int run_builtin_in_shell(const builtin *b, command_node *node, int in_fd, int out_fd) {
+    fd_action *fds;
+    int fd_count;
+    if (prepare_redirects(node, 2, &fds, &fd_count) != 0) {
+        close_redirects(fds, fd_count);
+        return 1;
+    }
+    int first = 2; // The reserved slots in use come right before the redirections
+    if (out_fd != STDOUT_FILENO) {
+        first--;
+        fds[first].fd = STDOUT_FILENO;
+        fds[first].source = out_fd;
+    }
+    if (in_fd != STDIN_FILENO && (b->flags & BUILTIN_READS_STDIN)) {
+        first--;
+        fds[first].fd = STDIN_FILENO;
+        fds[first].source = in_fd;
+    }
+    int *saved_fds = redirect_shell_fds(fds + first, fd_count - first);
+    struct rusage before;
+    if (active_metrics != NULL) {
+        getrusage(RUSAGE_SELF, &before);
+    }
+    double traced = trace_now();
+    int status = b->handler(node->argv);
+    if (trace_fd != -1) {
+        char trace_args[96];
+        snprintf(trace_args, sizeof(trace_args), "\"stdin\":%d,\"stdout\":%d,\"status\":%d", in_fd, out_fd, status);
+        trace_span("builtin", b->name, traced, trace_pid, trace_args);
+    }
+    if (active_metrics != NULL) {
+        charge_shell_usage(&before);
+    }
+    restore_shell_fds(fds + first, fd_count - first, saved_fds);
+    close_redirects(fds, fd_count);
+    return status;
+}
+
+// Fork a child running node with in_fd as stdin and out_fd as stdout, then the
+// fd actions applied; close_fd (or -1) is closed in the child. pgid is as for
+// launch_command. Returns the pid or -1.
+pid_t fork_stage(command_node *node, int in_fd, int out_fd, int close_fd, fd_action *fds, int fd_count, pid_t pgid) {
+    flush_output();
+    struct timespec started, forked;
+    if (active_metrics != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &started);
+    }
+    double traced = trace_now();
+    pid_t pid = fork();
+    if (pid > 0 && active_metrics != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &forked);
+        active_metrics->spawn_seconds += elapsed_seconds(&started, &forked);
+    }
+    if (pid > 0 && trace_fd != -1) {
+        char trace_args[96];
+        snprintf(trace_args, sizeof(trace_args), "\"pid\":%d,\"stdin\":%d,\"stdout\":%d", (int)pid, in_fd, out_fd);
+        trace_span("shell", "fork", traced, trace_pid, trace_args);
+        trace_process_name(pid, node->type == NODE_SUBSHELL ? "subshell" : node->argv[0]);
+    }
+    if (pid == 0) {
+        if (pgid != -1) {
+            setpgid(0, pgid);
+        }
+        enter_child_shell();
+        if (in_fd != STDIN_FILENO) {
+            dup2(in_fd, STDIN_FILENO); // Set input for the child process
+            close(in_fd);
+        }
+        if (out_fd != STDOUT_FILENO) {
+            dup2(out_fd, STDOUT_FILENO); // Set output for the child process
+            close(out_fd);
+        }
+        if (close_fd != -1) {
+            close(close_fd);
+        }
+        apply_fd_actions(fds, fd_count);
+        int child_status = run_forked_stage(node);
+        flush_output();
+        _exit(child_status); // _exit so the shared stdin buffer isn't rewound by the child
+    }
+    return pid;
+}
+
+// Expansion of $NAME, ${NAME}, $(list) and ~ in words, right before a command
+// runs. Text gathered along the way (a field, a command's output) goes in a
+// malloc'd buffer that doubles as it grows.
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} text_buffer;
+
+// Make room for more bytes plus a terminating '\0'
+void text_reserve(text_buffer *b, size_t more) {
+    if (b->len + more + 1 > b->cap) {
+        size_t cap = b->cap > 0 ? b->cap : 64;
+        while (cap < b->len + more + 1) {
+            cap *= 2;
+        }
+        char *grown = realloc(b->data, cap);
+        if (grown == NULL) {
+            out_printf("Invalid Command\n");
+            exit(EXIT_FAILURE);
+        }
+        b->data = grown;
+        b->cap = cap;
+    }
+}
+
+void text_append(text_buffer *b, const char *text, size_t n) {
+    text_reserve(b, n);
+    memcpy(b->data + b->len, text, n);
+    b->len += n;
+    b->data[b->len] = '\0';
+}
+
+// Read fd to end of file onto the end of b
+void text_read_fd(text_buffer *b, int fd) {
+    while (1) {
+        text_reserve(b, SUBSTITUTION_READ_SIZE);
+        ssize_t n = read(fd, b->data + b->len, b->cap - b->len - 1);
+        if (n > 0) {
+            b->len += n;
+        } else if (n == 0 || errno != EINTR) {
+            break;
+        }
+    }
+    b->data[b->len] = '\0';
+}
+
+// Status of the last command substitution, which a command that expands to no
+// words (or only assigns variables) returns as its own
+int substitution_status = 0;
+
+// Whether node can run with the shell's own stdout pointed elsewhere: nothing in
+// it changes the shell (cd, export, an assignment...) or runs in the background
+int substitution_in_shell(command_node *node) {
+    switch (node->type) {
+    case NODE_COMMAND: {
+        if (node->words != NULL && node->words[0].raw != NULL) {
+            return 0; // Which command it is isn't known yet
+        }
+        if (node->assignments > 0) {
+            return 0;
+        }
+        const builtin *b = find_builtin(node->argv[0]);
+        return b == NULL || !(b->flags & BUILTIN_CHANGES_SHELL);
+    }
+    case NODE_SUBSHELL:
+        return 1;
+    case NODE_PIPELINE:
+        for (int i = 0; i < node->stage_count; i++) {
+            if (!substitution_in_shell(node->stages[i])) {
+                return 0;
+            }
+        }
+        return 1;
+    case NODE_AND:
+    case NODE_OR:
+    case NODE_SEQUENCE:
+        return substitution_in_shell(node->left) && substitution_in_shell(node->right);
+    default:
+        return 0;
+    }
+}
+
+// Run the command list in text[0..len) for $( ... ) and append its output to out.
+// When nothing in it could change the shell, it runs right here with stdout on
+// an anonymous file, so builtins like history cost no process at all; otherwise
+// a forked child shell runs it into a pipe. Either way the output is read in a
+// single loop once the list is done.
+void run_substitution(const char *text, size_t len, text_buffer *out) {
+    char *line = arena_alloc(&command_arena, len + 1);
+    memcpy(line, text, len);
+    line[len] = '\0';
+    token *tokens;
+    int token_count = tokenize(line, &command_arena, &tokens);
+    command_node *root = token_count > 0 ? parse_command_line(tokens, token_count) : NULL;
+    if (token_count < 0 || (token_count > 0 && root == NULL)) {
+        out_printf("Invalid Command\n");
+        substitution_status = last_status = 2;
+        return;
+    }
+    if (root == NULL) {
+        substitution_status = last_status = 0; // $( )
+        return;
+    }
+
+    pipeline_metrics *metrics = active_metrics; // The inner pipelines aren't stages of the outer one
+    active_metrics = NULL;
+    int status = 1;
+    flush_output();
+    int memory_fd = substitution_in_shell(root) ? memfd_create("substitution", MFD_CLOEXEC) : -1;
+    int saved_fd = memory_fd != -1 ? fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10) : -1;
+    if (saved_fd != -1) {
+        dup2(memory_fd, STDOUT_FILENO);
+        capturing_output++;
+        status = execute_node(root);
+        capturing_output--;
+        flush_output();
+        dup2(saved_fd, STDOUT_FILENO);
+        close(saved_fd);
+        lseek(memory_fd, 0, SEEK_SET);
+        text_read_fd(out, memory_fd);
+    } else {
+        int pipe_fd[2];
+        pid_t pid = pipe2(pipe_fd, O_CLOEXEC) == 0 ? fork() : -1;
+        if (pid == 0) {
+            if (shell_interactive) {
+                // A foreground group of its own, so Ctrl-C reaches it and not the shell
+                setpgid(0, 0);
+                tcsetpgrp(STDIN_FILENO, getpid());
+            }
+            enter_child_shell();
+            signal(SIGTSTP, SIG_IGN); // Nothing could resume it: the shell is blocked on its output
+            dup2(pipe_fd[1], STDOUT_FILENO);
+            int child_status = execute_node(root);
+            flush_output();
+            _exit(child_status); // _exit so the shared stdin buffer isn't rewound by the child
+        }
+        if (pid > 0) {
+            close(pipe_fd[1]);
+            if (shell_interactive) {
+                setpgid(pid, pid);
+                tcsetpgrp(STDIN_FILENO, pid);
+            }
+            text_read_fd(out, pipe_fd[0]);
+            close(pipe_fd[0]);
+            int wait_status;
+            while (waitpid(pid, &wait_status, 0) == -1 && errno == EINTR) {
+            }
+            status = exit_status(wait_status);
+            take_terminal();
+        } else {
+            out_printf("Invalid Command\n");
+        }
+    }
+    if (memory_fd != -1) {
+        close(memory_fd);
+    }
+    active_metrics = metrics;
+    substitution_status = last_status = status;
+}
+
+// State while expanding one word into fields
+typedef struct {
+    text_buffer text;    // The field being built
+    text_buffer pattern; // The same field as a glob pattern, quoted characters escaped
+    int globbing;        // The field has an unquoted * ? or [
+    int started;         // The field exists, even if empty (it had quotes or text)
+    int split;           // Split unquoted expansions into fields and glob them; else one field, as is
+    glob_results *out;   // Finished fields
+} word_expansion;
+
+// End the field being built, globbing it if it has wildcards
+void finish_field(word_expansion *w) {
+    if (!w->started) {
+        return;
+    }
+    char *field = arena_alloc(&command_arena, w->text.len + 1);
+    memcpy(field, w->text.data, w->text.len + 1);
+    size_t start = w->out->count;
+    if (w->split && w->globbing) {
+        expand_glob(w->pattern.data, w->out);
+    }
+    if (w->out->count == start) {
+        add_glob_result(w->out, field);
+    }
+    w->text.len = 0;
+    w->pattern.len = 0;
+    w->globbing = 0;
+    w->started = 0;
+}
+
+// Add n characters of text to the field. The result of an unquoted expansion is
+// split into fields at blanks; quoted text only ever matches itself as a pattern.
+void expand_append(word_expansion *w, const char *text, size_t n, int quoted, int expanded) {
+    text_reserve(&w->text, n);
+    text_reserve(&w->pattern, 2 * n);
+    for (size_t i = 0; i < n; i++) {
+        char c = text[i];
+        if (expanded && !quoted && w->split && (c == ' ' || c == '\t' || c == '\n')) {
+            finish_field(w);
+            continue;
+        }
+        int wild = c == '*' || c == '?' || c == '[';
+        if (c == '\\' || (quoted && (wild || c == ']'))) {
+            w->pattern.data[w->pattern.len++] = '\\';
+        }
+        w->pattern.data[w->pattern.len++] = c;
+        w->pattern.data[w->pattern.len] = '\0';
+        w->text.data[w->text.len++] = c;
+        w->text.data[w->text.len] = '\0';
+        w->globbing |= wild && !quoted;
+        w->started = 1;
+    }
+}
+
+// Expand the $ expansion at p; returns the position past it
+const char *expand_dollar(word_expansion *w, const char *p, int quoted) {
+    char number[24];
+    const char *value = NULL;
+    const char *end = p + 2;
+    if (p[1] == '(') {
+        end = skip_substitution(p + 1); // The tokenizer saw it close
+        text_buffer output = { NULL, 0, 0 };
+        run_substitution(p + 2, end - 1 - (p + 2), &output);
+        while (output.len > 0 && output.data[output.len - 1] == '\n') {
+            output.len--;
+        }
+        if (output.len > 0) {
+            expand_append(w, output.data, output.len, quoted, 1);
+        }
+        free(output.data);
+        return end;
+    } else if (p[1] == '{') {
+        const char *close = strchr(p + 2, '}');
+        if (close == NULL || !valid_variable_name(p + 2, close - (p + 2))) {
+            expand_append(w, p, 1, quoted, 0); // Not one we know: a plain '$'
+            return p + 1;
+        }
+        variable *v = find_variable(p + 2, close - (p + 2));
+        value = v != NULL ? v->value : NULL;
+        end = close + 1;
+    } else if (isalpha((unsigned char)p[1]) || p[1] == '_') {
+        while (isalnum((unsigned char)*end) || *end == '_') {
+            end++;
+        }
+        variable *v = find_variable(p + 1, end - (p + 1));
+        value = v != NULL ? v->value : NULL;
+    } else if (p[1] == '0') {
+        value = shell_name;
+    } else if (p[1] == '?' || p[1] == '$' || (p[1] == '!' && last_background_pid > 0)) {
+        int n = p[1] == '?' ? last_status : p[1] == '$' ? (int)shell_pid : (int)last_background_pid;
+        snprintf(number, sizeof(number), "%d", n);
+        value = number;
+    } else if (p[1] == '#') {
+        value = "0";
+    } // $1 to $9 and a $! before any job are empty
+    if (value != NULL) {
+        expand_append(w, value, strlen(value), quoted, 1);
+    }
+    return end;
+}
+
+// Expand a ~ or ~user at p, up to the next '/'; returns the position past it,
+// or p itself when it is to stay as written
+const char *expand_tilde(word_expansion *w, const char *p) {
+    size_t len = strcspn(p + 1, "/:");
+    if (memchr(p + 1, '\'', len) || memchr(p + 1, '"', len) || memchr(p + 1, '\\', len) || memchr(p + 1, '$', len)) {
+        return p;
+    }
+    const char *home;
+    if (len == 0) {
+        home = get_variable("HOME");
+    } else {
+        char *name = arena_alloc(&command_arena, len + 1);
+        memcpy(name, p + 1, len);
+        name[len] = '\0';
+        struct passwd *pw = getpwnam(name);
+        home = pw != NULL ? pw->pw_dir : NULL;
+    }
+    if (home == NULL) {
+        return p;
+    }
+    expand_append(w, home, strlen(home), 1, 0);
+    return p + 1 + len;
+}
+
+// Expand a word as written (quotes and all) into fields added to out. With split,
+// unquoted expansions are split at blanks and fields with wildcards globbed; an
+// unquoted word that expands to nothing adds no field at all. Without split (an
+// assignment or a redirection target) the word is always exactly one field, and
+// a ~ after a ':' is expanded too.
+void expand_word(const char *raw, int split, glob_results *out) {
+    word_expansion w = { { NULL, 0, 0 }, { NULL, 0, 0 }, 0, 0, split, out };
+    text_reserve(&w.text, 0);
+    text_reserve(&w.pattern, 0);
+    w.text.data[0] = '\0';
+    w.pattern.data[0] = '\0';
+    const char *p = raw;
+    while (*p != '\0') {
+        if (*p == '\'') {
+            const char *close = strchr(p + 1, '\'');
+            w.started = 1;
+            expand_append(&w, p + 1, close - (p + 1), 1, 0);
+            p = close + 1;
+        } else if (*p == '"') {
+            w.started = 1;
+            for (p++; *p != '"';) {
+                if (*p == '$' && starts_expansion(p[1])) {
+                    p = expand_dollar(&w, p, 1);
+                } else if (*p == '\\' && p[1] != '\0' && strchr("$`\"\\\n", p[1]) != NULL) {
+                    expand_append(&w, p + 1, 1, 1, 0);
+                    p += 2;
+                } else {
+                    expand_append(&w, p++, 1, 1, 0);
+                }
+            }
+            p++;
+        } else if (*p == '\\') {
+            if (p[1] != '\0') {
+                expand_append(&w, p + 1, 1, 1, 0);
+                p++;
+            }
+            p++;
+        } else if (*p == '$' && starts_expansion(p[1])) {
+            p = expand_dollar(&w, p, 0);
+        } else if (*p == '~' && (p == raw || (!split && p[-1] == ':')) && expand_tilde(&w, p) != p) {
+            p += 1 + strcspn(p + 1, "/:");
+        } else {
+            expand_append(&w, p++, 1, 0, 0);
+        }
+    }
+    if (!split) {
+        w.started = 1;
+    }
+    finish_field(&w);
+    free(w.text.data);
+    free(w.pattern.data);
+}
+
+// Expand a word that must stay one word: an assignment's value or a redirection target
+char *expand_single(const char *raw) {
+    glob_results out = { NULL, 0, 0 };
+    expand_word(raw, 0, &out);
+    char *text = out.items[0];
+    free(out.items);
+    return text;
+}
+
+// Set the variables of a command made only of NAME=value words; returns the
+// status of the last command substitution in them, or 0
+int assign_variables(command_node *node) {
+    substitution_status = 0;
+    for (int i = 0; node->argv[i] != NULL; i++) {
+        const char *word = node->words != NULL && node->words[i].raw != NULL ? node->words[i].raw : node->argv[i];
+        size_t name_len = strchr(word, '=') - word;
+        char *name = arena_alloc(&command_arena, name_len + 1);
+        memcpy(name, word, name_len);
+        name[name_len] = '\0';
+        const char *value = node->words != NULL && node->words[i].raw != NULL ? expand_single(word + name_len + 1)
+                                                                               : node->argv[i] + name_len + 1;
+        if (set_variable(name, value, 0) != 0) {
+            out_printf("Invalid Command\n");
+            return 1;
+        }
+    }
+    return substitution_status;
+}
+
+void expand_redirects(command_node *node) {
+    for (int i = 0; i < node->redirect_count; i++) {
+        if (node->redirects[i].raw != NULL) {
+            node->redirects[i].target = expand_single(node->redirects[i].raw);
+            node->redirects[i].raw = NULL;
+        }
+    }
+}
+
+// Expand a command's words and redirection targets right before it runs. All of
+// its fields are gathered in one growing array and copied into argv once.
+void expand_command(command_node *node) {
+    expand_redirects(node);
+    if (node->words == NULL) {
+        return;
+    }
+    glob_results out = { NULL, 0, 0 };
+    for (int i = 0; node->argv[i] != NULL; i++) {
+        token *word = &node->words[i];
+        size_t start = out.count;
+        if (word->raw != NULL) {
+            expand_word(word->raw, 1, &out);
+            continue;
+        }
+        if (word->pattern != NULL) {
+            expand_glob(word->pattern, &out);
+        }
+        if (out.count == start) {
+            add_glob_result(&out, node->argv[i]);
+        }
+    }
+    node->argv = arena_alloc(&command_arena, (out.count + 1) * sizeof(char *));
+    if (out.count > 0) {
+        memcpy(node->argv, out.items, out.count * sizeof(char *));
+    }
+    node->argv[out.count] = NULL;
+    node->words = NULL;
+    free(out.items);
+}
+
+// Execute a pipeline of stage_total stages; returns the exit status of the last one
+int run_pipeline(command_node **stages, int stage_total) {
+    char **args = NULL;
+    int pipe_fd[2];
+    int in_fd = 0; // Input file descriptor
+    int status = 0; // Exit status of the last stage
+
+    // Every stage is forked up front, so keep their pids for a single reap at the end
+    pipeline_state ps = { arena_alloc(&command_arena, stage_total * sizeof(pid_t)), 0, 0, 0, NULL };
+    if (trace_fd != -1) {
+        ps.started = arena_alloc(&command_arena, stage_total * sizeof(double));
+    }
+
+    // A command of nothing but NAME=value words sets shell variables, its
+    // redirections in place while it does
+    command_node *first = stages[0];
+    if (stage_total == 1 && first->type == NODE_COMMAND && first->argv[first->assignments] == NULL) {
+        expand_redirects(first);
+        fd_action *fds;
+        int fd_count;
+        if (prepare_redirects(first, 0, &fds, &fd_count) != 0) {
+            close_redirects(fds, fd_count);
+            return 1;
+        }
+        int *saved_fds = redirect_shell_fds(fds, fd_count);
+        status = assign_variables(first);
+        restore_shell_fds(fds, fd_count, saved_fds);
+        close_redirects(fds, fd_count);
+        return status;
+    }
+
+    substitution_status = 0;
+    for (int stage = 0; stage < stage_total; stage++) {
+        expand_command(stages[stage]);
+        if (stages[stage]->type == NODE_COMMAND && stages[stage]->argv[0] == NULL) {
+            if (stage_total == 1) {
+                return substitution_status; // Nothing left to run
+            }
+            out_printf("Invalid Command\n");
+            return 1;
+        }
+    }
+
+    for (int stage = 0; stage < stage_total - 1; stage++) {
+        if (active_metrics != NULL) {
+            active_metrics->stage = stage;
+        }
+        // A builtin with short output runs right here, collecting its output in an
+        // anonymous file that the next stage then reads as its stdin: no fork, no
+        // pipe. One that changes the shell (cd, fg...) runs in a child like any
+        // stage, so the pipeline leaves the shell alone.
+        const builtin *b = stage_builtin(stages[stage]);
+        int buffer_fd = b != NULL && (b->flags & BUILTIN_PIPELINE_SAFE) && !(b->flags & BUILTIN_CHANGES_SHELL)
+            ? memfd_create("builtin", MFD_CLOEXEC) : -1;
+        if (buffer_fd != -1) {
+            run_builtin_in_shell(b, stages[stage], in_fd, buffer_fd);
+            lseek(buffer_fd, 0, SEEK_SET);
+            if (in_fd != 0) {
+                close(in_fd);
+            }
+            in_fd = buffer_fd;
+            continue;
+        }
+
+        if (pipe2(pipe_fd, O_CLOEXEC) == -1) {
+            out_printf("Invalid Command\n");
+            finish_pipeline(in_fd, &ps);
+            return 1;
+        }
+
+        // The command before the pipe
+        pid_t pid = -1;
+        fd_action *fds;
+        int fd_count;
+        if (prepare_redirects(stages[stage], 0, &fds, &fd_count) == 0) {
+            if (b != NULL || stages[stage]->type == NODE_SUBSHELL) {
+                pid = fork_stage(stages[stage], in_fd, pipe_fd[1], pipe_fd[0], fds, fd_count, stage_group(&ps));
+            } else {
+                pid = launch_command(stages[stage]->argv, in_fd, pipe_fd[1], fds, fd_count, stage_group(&ps));
+            }
+            if (pid <= 0) {
+                out_printf("Invalid Command\n");
+            }
+        }
+        close_redirects(fds, fd_count);
+
+        if (pid > 0) {
+            add_stage(&ps, pid); // Don't wait: the next stage must start reading now
+        }
+
+        close(pipe_fd[1]); // Close write end of the pipe in the parent
+        if (in_fd != 0) {
+            close(in_fd); // The stage just forked owns the previous read end now
+        }
+        in_fd = pipe_fd[0]; // Set up input for the next command
+    }
+
+    // Execute the last command
+    if (active_metrics != NULL) {
+        active_metrics->stage = stage_total - 1;
+    }
+    command_node *last = stages[stage_total - 1];
+    args = last->argv;
+    const builtin *b = stage_builtin(last);
+
+    // Under job control a builtin reading the pipe must be a process of the job,
+    // or Ctrl-Z would stop the writers and leave the shell blocked on the read.
+    // So must one reading the terminal, so Ctrl-Z and Ctrl-C reach it rather
+    // than the shell. One that waits on processes of its own is forked too, so
+    // it stops with them and picks up where it left off on fg
+    int fork_last = last->type == NODE_SUBSHELL || (b != NULL && !(b->flags & BUILTIN_IN_PROCESS))
+        || (shell_interactive && b != NULL && (b->flags & BUILTIN_READS_STDIN)
+            && (in_fd != 0 || !stage_redirects(last, STDIN_FILENO)))
+        || (shell_interactive && b != NULL && (b->flags & BUILTIN_WAITS_ON_RUNS));
+
+    // Open its redirections
+    fd_action *fds = NULL;
+    int fd_count = 0;
+    int redirect_failed = 0;
+    if (b == NULL || fork_last) {
+        redirect_failed = prepare_redirects(last, 0, &fds, &fd_count) != 0;
+    }
+
+    if (b != NULL && !fork_last) {
+        // Builtins run in the shell itself, reading the pipe directly
+        status = run_builtin_in_shell(b, last, in_fd, STDOUT_FILENO);
+    } else if (redirect_failed) {
+        status = 1;
+    } else if (fork_last) {
+        // Handle '( list )': run it in a child so cd and friends don't leak out
+        pid_t pid = fork_stage(last, in_fd, STDOUT_FILENO, -1, fds, fd_count, stage_group(&ps));
+        if (pid > 0) {
+            add_stage(&ps, pid);
+            if (in_fd != 0) {
+                close(in_fd);
+                in_fd = 0;
+            }
+            status = exit_status(wait_pipeline(&ps));
+        } else {
+            out_printf("Invalid Command\n");
+            status = 1;
+        }
+    } else {
+        // Handle other commands
+        pid_t pid = launch_command(args, in_fd, STDOUT_FILENO, fds, fd_count, stage_group(&ps));
+        if (pid > 0) {
+            add_stage(&ps, pid);
+            if (in_fd != 0) {
+                close(in_fd);
+                in_fd = 0;
+            }
+            status = exit_status(wait_pipeline(&ps)); // A stopped command becomes a job below
+        } else {
+            out_printf("Invalid Command\n");
+            status = 127;
+        }
+    }
+
+    close_redirects(fds, fd_count);
+
+    // Builtins in the last stage never read the pipe; drop it so upstream stages can finish
+    finish_pipeline(in_fd, &ps);
+
+    // Ctrl-Z: keep the stopped stages as a job for fg/bg
+    if (ps.stopped) {
+        job *j = add_job(ps.pgid, ps.pids, ps.count, JOB_STOPPED, stages, stage_total);
+        if (j != NULL) {
+            out_printf("\n");
+            print_job(j);
+        } else {
+            kill(-ps.pgid, SIGKILL); // Nowhere to keep it; don't leave it stopped forever
+            out_printf("Invalid Command\n");
+        }
+    }
+    return status;
+}
+
+// Recursive-descent parser over the token array
+typedef struct {
+    token *tokens; // Tokens of the command line
+    int count;     // Number of tokens
+    int pos;       // Next token to look at
+} parser;
+
+command_node *parse_list(parser *p);
+
+// Whether the next token is of the given type
+int parser_at(parser *p, token_type type) {
+    return p->pos < p->count && p->tokens[p->pos].type == type;
+}
+
+// Allocate a node of the given type from the command arena
+command_node *new_node(node_type type) {
+    command_node *node = arena_alloc(&command_arena, sizeof(command_node));
+    memset(node, 0, sizeof(command_node));
+    node->type = type;
+    return node;
+}
+
+// Whether a token is a redirection operator
+int is_redirect(token_type type) {
+    return type >= TOKEN_LESS && type <= TOKEN_TLESS;
+}
+
+// command  := (WORD | redirect)+ | '(' list ')' redirect*
+// redirect := ('<' | '>' | '>>' | '<&' | '>&' | '<<<') WORD
+command_node *parse_command(parser *p) {
+    command_node *node;
+    if (parser_at(p, TOKEN_LPAREN)) {
+        p->pos++;
+        command_node *body = parse_list(p);
+        if (body == NULL || !parser_at(p, TOKEN_RPAREN)) {
+            return NULL;
+        }
+        p->pos++;
+        node = new_node(NODE_SUBSHELL);
+        node->left = body;
+    } else {
+        node = new_node(NODE_COMMAND);
+    }
+
+    // Count the words and redirections first so each array is allocated once
+    int start = p->pos;
+    int word_count = 0;
+    while (1) {
+        if (node->type == NODE_COMMAND && parser_at(p, TOKEN_WORD)) {
+            word_count++;
+            p->pos++;
+        } else if (p->pos < p->count && is_redirect(p->tokens[p->pos].type)) {
+            if (p->pos + 1 >= p->count || p->tokens[p->pos + 1].type != TOKEN_WORD) {
+                return NULL; // Redirection without a target
+            }
+            node->redirect_count++;
+            p->pos += 2;
+        } else {
+            break;
+        }
+    }
+    if (node->type == NODE_COMMAND && word_count == 0) {
+        return NULL; // An operator where a command should be
+    }
+
+    if (node->type == NODE_COMMAND) {
+        node->argv = arena_alloc(&command_arena, (word_count + 1) * sizeof(char *));
+        for (int i = start; i < p->pos; i++) {
+            token *tok = &p->tokens[i];
+            if (tok->type == TOKEN_WORD && (tok->pattern != NULL || tok->raw != NULL) && (i == start || !is_redirect(tok[-1].type))) {
+                node->words = arena_alloc(&command_arena, word_count * sizeof(token));
+                break;
+            }
+        }
+    }
+    node->redirects = arena_alloc(&command_arena, node->redirect_count * sizeof(redirect));
+    int word = 0;
+    int redirect_index = 0;
+    for (int i = start; i < p->pos; i++) {
+        token *tok = &p->tokens[i];
+        if (tok->type == TOKEN_WORD) {
+            if (node->words != NULL) {
+                node->words[word] = *tok;
+            }
+            if (tok->assignment && node->assignments == word) {
+                node->assignments++;
+            }
+            node->argv[word++] = tok->text;
+            continue;
+        }
+        redirect *r = &node->redirects[redirect_index++];
+        r->type = tok->type;
+        r->fd = tok->fd;
+        if (r->fd == -1) {
+            r->fd = (tok->type == TOKEN_LESS || tok->type == TOKEN_LESSAND || tok->type == TOKEN_TLESS) ? STDIN_FILENO : STDOUT_FILENO;
+        }
+        r->target = p->tokens[++i].text;
+        r->raw = p->tokens[i].raw;
+    }
+    if (node->type == NODE_COMMAND) {
+        node->argv[word] = NULL;
+    }
+    return node;
+}
+
+// Whether a command can start at token i
+int starts_command(parser *p, int i) {
+    return i < p->count && (p->tokens[i].type == TOKEN_WORD || p->tokens[i].type == TOKEN_LPAREN
+                            || is_redirect(p->tokens[i].type));
+}
+
+// pipeline := ['time' ['-p']] command ('|' command)*
+command_node *parse_pipeline(parser *p) {
+    int timed = 0;
+    if (parser_at(p, TOKEN_WORD) && strcmp(p->tokens[p->pos].text, "time") == 0 && starts_command(p, p->pos + 1)) {
+        p->pos++;
+        timed = TIME_REPORT;
+        if (parser_at(p, TOKEN_WORD) && strcmp(p->tokens[p->pos].text, "-p") == 0 && starts_command(p, p->pos + 1)) {
+            p->pos++;
+            timed = TIME_POSIX;
+        }
+    }
+    command_node *first = parse_command(p);
+    if (first == NULL || !parser_at(p, TOKEN_PIPE)) {
+        if (first != NULL) {
+            first->timed = timed;
+        }
+        return first;
+    }
+
+    // Count the stages: pipes at this nesting level up to the end of the pipeline
+    int stage_total = 1;
+    int depth = 0;
+    for (int i = p->pos; i < p->count; i++) {
+        token_type type = p->tokens[i].type;
+        if (type == TOKEN_LPAREN) {
+            depth++;
+        } else if (type == TOKEN_RPAREN && depth > 0) {
+            depth--;
+        } else if (depth == 0 && type == TOKEN_PIPE) {
+            stage_total++;
+        } else if (depth == 0 && (type == TOKEN_AND || type == TOKEN_OR || type == TOKEN_SEMI || type == TOKEN_AMP
+                || type == TOKEN_RPAREN)) {
+            break;
+        }
+    }
+    command_node *node = new_node(NODE_PIPELINE);
+    node->stages = arena_alloc(&command_arena, stage_total * sizeof(command_node *));
+    node->stages[node->stage_count++] = first;
+    while (parser_at(p, TOKEN_PIPE)) {
+        p->pos++;
+        command_node *stage = parse_command(p);
+        if (stage == NULL) {
+            return NULL;
+        }
+        node->stages[node->stage_count++] = stage;
+    }
+    node->timed = timed;
+    return node;
+}
+
+// and_or := pipeline (('&&' | '||') pipeline)*
+command_node *parse_and_or(parser *p) {
+    command_node *node = parse_pipeline(p);
+    while (node != NULL && (parser_at(p, TOKEN_AND) || parser_at(p, TOKEN_OR))) {
+        command_node *joined = new_node(parser_at(p, TOKEN_AND) ? NODE_AND : NODE_OR);
+        p->pos++;
+        joined->left = node;
+        joined->right = parse_pipeline(p);
+        if (joined->right == NULL) {
+            return NULL;
+        }
+        node = joined;
+    }
+    return node;
+}
+
+// list := and_or ((';' | '&') and_or)* [';' | '&']
+// A '&' applies only to the and_or right before it.
+command_node *parse_list(parser *p) {
+    command_node *list = NULL;
+    while (1) {
+        command_node *item = parse_and_or(p);
+        if (item == NULL) {
+            return NULL;
+        }
+        if (parser_at(p, TOKEN_AMP)) {
+            command_node *background = new_node(NODE_BACKGROUND);
+            background->left = item;
+            item = background;
+        }
+        if (list == NULL) {
+            list = item;
+        } else {
+            command_node *joined = new_node(NODE_SEQUENCE);
+            joined->left = list;
+            joined->right = item;
+            list = joined;
+        }
+
+        if (!parser_at(p, TOKEN_SEMI) && !parser_at(p, TOKEN_AMP)) {
+            break;
+        }
+        p->pos++;
+        if (p->pos == p->count || parser_at(p, TOKEN_RPAREN)) {
+            break; // Trailing ';' or '&'
+        }
+    }
+    return list;
+}
+
+// Parse a whole command line; returns NULL on a syntax error
+command_node *parse_command_line(token *tokens, int count) {
+    parser p = { tokens, count, 0 };
+    command_node *root = parse_list(&p);
+    if (p.pos != count) {
+        return NULL; // Something like a stray ')' was left over
+    }
+    return root;
+}
+
+// Run a pipeline-level node (a command, subshell or pipeline) while collecting
+// its cost; report it if 'time' asked, and add it to the 'stats' histograms
+int run_measured(command_node *node) {
+    pipeline_metrics metrics;
+    memset(&metrics, 0, sizeof(metrics));
+    metrics.stage_count = node->type == NODE_PIPELINE ? node->stage_count : 1;
+    metrics.pids = arena_alloc(&command_arena, metrics.stage_count * sizeof(pid_t));
+    metrics.usage = arena_alloc(&command_arena, metrics.stage_count * sizeof(struct rusage));
+    memset(metrics.pids, 0, metrics.stage_count * sizeof(pid_t));
+    memset(metrics.usage, 0, metrics.stage_count * sizeof(struct rusage));
+    metrics.parse_seconds = line_parse_seconds;
+    line_parse_seconds = 0; // Charged to the line's first pipeline only
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    active_metrics = &metrics;
+    int status = node->type == NODE_PIPELINE ? run_pipeline(node->stages, node->stage_count) : run_pipeline(&node, 1);
+    active_metrics = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double real = elapsed_seconds(&start, &end);
+    struct rusage total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < metrics.stage_count; i++) {
+        add_rusage(&total, &metrics.usage[i]);
+    }
+    record_stats(&metrics, &total, real);
+    if (node->timed) {
+        print_time_report(node, &metrics, &total, real);
+    }
+    return status;
+}
+
+// Execute a parsed command tree in this shell process; returns its exit status
+int execute_node(command_node *node) {
+    if (exit_requested) {
+        return last_status; // 'exit' earlier in the line: the rest doesn't run
+    }
+    int status = 0;
+    switch (node->type) {
+    case NODE_COMMAND:
+    case NODE_SUBSHELL:
+        status = node->timed || stats_enabled ? run_measured(node) : run_pipeline(&node, 1);
+        break;
+    case NODE_PIPELINE:
+        status = node->timed || stats_enabled ? run_measured(node) : run_pipeline(node->stages, node->stage_count);
+        break;
+    case NODE_AND:
+        status = execute_node(node->left);
+        if (status == 0) {
+            status = execute_node(node->right);
+        }
+        break;
+    case NODE_OR:
+        status = execute_node(node->left);
+        if (status != 0) {
+            status = execute_node(node->right);
+        }
+        break;
+    case NODE_SEQUENCE:
+        execute_node(node->left);
+        status = execute_node(node->right);
+        break;
+    case NODE_BACKGROUND:
+        status = start_background_job(node->left);
+        break;
+    }
+    last_status = status;
+    return status;
+}
+
+// Execute the given command line
+void run_command(char *cmd) {
+    struct timespec started, parsed;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    double traced = trace_now();
+    char trace_args[512] = "";
+    if (trace_fd != -1) {
+        char line[480];
+        trace_escape(line, sizeof(line), cmd); // Before tokenizing cuts it up
+        snprintf(trace_args, sizeof(trace_args), "\"line\":\"%s\"", line);
+    }
+    token *tokens;
+    int token_count = tokenize(cmd, &command_arena, &tokens);
+    if (token_count < 0) {
+        out_printf("Invalid Command\n");
+        last_status = 2;
+    } else if (token_count > 0) {
+        command_node *root = parse_command_line(tokens, token_count);
+        clock_gettime(CLOCK_MONOTONIC, &parsed);
+        line_parse_seconds = elapsed_seconds(&started, &parsed);
+        trace_span("shell", "parse", traced, trace_pid, trace_args);
+        if (root == NULL) {
+            out_printf("Invalid Command\n");
+            last_status = 2;
+        } else {
+            execute_node(root);
+        }
+    }
+    trace_span("shell", "command", traced, trace_pid, trace_args);
+    arena_reset(&command_arena); // Everything the command allocated goes at once
+}
+
+// Remove leading and trailing spaces from a string
+void trim_spaces(char *str) {
+    if (str == NULL || *str == '\0') {
+        return;
+    }
+
+    // Remove leading spaces
+    char *start = str;
+    while (*start == ' ') {
+        start++;
+    }
+
+    // If the string is only spaces, return empty
+    if (*start == '\0') {
+        *str = '\0';
+        return;
+    }
+
+    // Remove trailing spaces
+    char *end = start + strlen(start) - 1;
+    while (end > start && *end == ' ') {
+        end--;
+    }
+
+    // Null terminate the string after the last non-space character
+    *(end + 1) = '\0';
+
+    // Move trimmed string to the beginning
+    if (start != str) {
+        memmove(str, start, strlen(start) + 1);
+    }
+}
+
+// Line editing for the interactive prompt. The terminal is in raw mode only while
+// a line is read, so commands run with it as they found it. Each keystroke is
+// answered with a single write() that redraws the line from the first column that
+// changed; a line wider than the terminal scrolls sideways under the prompt.
+typedef enum {
+    EDIT_NONE = 256, // Keys past the byte range, decoded from escape sequences
+    EDIT_UP,
+    EDIT_DOWN,
+    EDIT_LEFT,
+    EDIT_RIGHT,
+    EDIT_HOME,
+    EDIT_END,
+    EDIT_DELETE
+} edit_key;
+
+typedef struct {
+    char **buf;        // The line, in the caller's getline-style buffer
+    size_t *cap;       // Size of *buf
+    size_t len;        // Bytes in the line
+    size_t pos;        // Cursor offset in the line
+    const char *prompt;
+    size_t prompt_len;
+    size_t columns;    // Terminal width at the last redraw
+    size_t offset;     // First byte of the line shown after the prompt
+    char *shown;       // What the screen holds after the prompt
+    size_t shown_len;
+    size_t shown_cap;
+    int stale;         // The screen line must be redrawn from the prompt on
+    size_t cursor;     // Screen column of the cursor, counted from after the prompt
+    int recall;        // History entry on the line; history_count for the new line
+    char *draft;       // The new line, kept while browsing history
+    char *out;         // Output queued for the current keystroke
+    size_t out_len;
+    size_t out_cap;
+} line_editor;
+
+// Queue terminal output for the current keystroke
+void edit_output(line_editor *ed, const char *text, size_t n) {
+    if (n == 0) {
+        return;
     }
-    history[history_count] = strdup(cmd); // Duplicate the command string
-    if (history[history_count] == NULL) {
-        printf("Invalid Command\n");
-        exit(EXIT_FAILURE);
+    if (ed->out_len + n > ed->out_cap) {
+        size_t cap = ed->out_cap > 0 ? ed->out_cap : 256;
+        while (cap < ed->out_len + n) {
+            cap *= 2;
+        }
+        char *grown = realloc(ed->out, cap);
+        if (grown == NULL) {
+            ed->stale = 1; // Dropped; the next full redraw repairs the screen
+            return;
+        }
+        ed->out = grown;
+        ed->out_cap = cap;
     }
-    history_count++;
+    memcpy(ed->out + ed->out_len, text, n);
+    ed->out_len += n;
 }
 
-// Print the command history
-void print_history() {
-    for (int i = 0; i < history_count; i++) {
-        printf("%s\n", history[i]);
+// Send everything queued for this keystroke in one write
+void edit_flush(line_editor *ed) {
+    size_t done = 0;
+    while (done < ed->out_len) {
+        ssize_t n = write(STDOUT_FILENO, ed->out + done, ed->out_len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += (size_t)n;
     }
+    ed->out_len = 0;
 }
 
-// Parse command into arguments
-void parse_arguments(char *cmd, char ***args, int *args_count, int *args_size) {
-    *args_count = 0;
-    *args = malloc(*args_size * sizeof(char *)); // Allocate memory for arguments
-    if (*args == NULL) {
-        printf("Invalid Command\n");
-        exit(EXIT_FAILURE);
+// Queue a cursor move along the screen line to column (counted after the prompt)
+void edit_move_cursor(line_editor *ed, size_t column) {
+    char move[32];
+    int n = 0;
+    if (column < ed->cursor) {
+        n = snprintf(move, sizeof(move), "\x1b[%zuD", ed->cursor - column);
+    } else if (column > ed->cursor) {
+        n = snprintf(move, sizeof(move), "\x1b[%zuC", column - ed->cursor);
     }
+    edit_output(ed, move, (size_t)n);
+    ed->cursor = column;
+}
 
-    char *token = strtok(cmd, " \n"); // Split command by spaces and newlines
-    while (token != NULL) {
-        // Resize arguments array if necessary
-        if (*args_count >= *args_size) {
-            *args_size *= 2;
-            *args = realloc(*args, *args_size * sizeof(char *));
-            if (*args == NULL) {
-                printf("Invalid Command\n");
-                exit(EXIT_FAILURE);
-            }
-        }
-
-        // Handle quoted strings
-        if (token[0] == '"') {
-            char *end_quote = strchr(token + 1, '"');
-            if (end_quote != NULL) {
-                *end_quote = '\0'; // Null-terminate the quoted string
-                (*args)[*args_count] = strdup(token + 1); // Skip the opening quote
-                if ((*args)[*args_count] == NULL) {
-                    printf("Invalid Command\n");
-                    exit(EXIT_FAILURE);
-                }
-                (*args_count)++;
-                token = strtok(NULL, " \n");
-            } else {
-                // If no ending quote is found, treat the rest of the string as part of the argument
-                (*args)[*args_count] = strdup(token);
-                if ((*args)[*args_count] == NULL) {
-                    printf("Invalid Command\n");
-                    exit(EXIT_FAILURE);
-                }
-                (*args_count)++;
-                break;
-            }
-        } else {
-            (*args)[*args_count] = strdup(token);
-            if ((*args)[*args_count] == NULL) {
-                printf("Invalid Command\n");
-                exit(EXIT_FAILURE);
-            }
-            (*args_count)++;
-            token = strtok(NULL, " \n");
-        }
+// Width of the terminal, 80 when it won't say
+size_t terminal_columns(void) {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+        return ws.ws_col;
     }
-    (*args)[*args_count] = NULL; // Null-terminate the arguments array
+    return 80;
 }
 
-// Execute the given command
-void run_command(char *cmd) {
-    char **args = NULL;
-    int args_size = INITIAL_ARGS_SIZE;
-    int args_count = 0;
-    char *pipe_pos = strchr(cmd, '|'); // Check for pipes
-    int pipe_fd[2];
-    int in_fd = 0; // Input file descriptor
-    int status;
+// Bring the screen up to date with the line. Unless the prompt must be redrawn
+// (first draw, resize, scrolling), only the text from the first column that
+// differs from what is shown is rewritten.
+void edit_refresh(line_editor *ed) {
+    size_t columns = terminal_columns();
+    if (columns != ed->columns) {
+        ed->columns = columns;
+        ed->stale = 1;
+    }
+    size_t width = columns > ed->prompt_len + 1 ? columns - ed->prompt_len - 1 : 1; // Last column stays free
+
+    // Scroll just enough to keep the cursor in view, without blank room past the end
+    size_t offset = ed->offset;
+    if (offset + width > ed->len + 1) {
+        offset = ed->len + 1 > width ? ed->len + 1 - width : 0;
+    }
+    if (ed->pos < offset) {
+        offset = ed->pos;
+    } else if (ed->pos >= offset + width) {
+        offset = ed->pos + 1 - width;
+    }
+    if (offset != ed->offset) {
+        ed->offset = offset;
+        ed->stale = 1;
+    }
 
-    while (pipe_pos) {
-        *pipe_pos = '\0'; // Split the command at the pipe
+    const char *visible = *ed->buf + offset;
+    size_t visible_len = ed->len - offset < width ? ed->len - offset : width;
+    size_t same = 0;
+    if (ed->stale) {
+        edit_output(ed, "\r", 1);
+        edit_output(ed, ed->prompt, ed->prompt_len);
+        ed->cursor = 0;
+    } else {
+        while (same < ed->shown_len && same < visible_len && ed->shown[same] == visible[same]) {
+            same++;
+        }
+    }
+    if (same < visible_len || ed->shown_len > visible_len || ed->stale) {
+        edit_move_cursor(ed, same);
+        edit_output(ed, visible + same, visible_len - same);
+        ed->cursor = visible_len;
+        if (ed->stale || ed->shown_len > visible_len) {
+            edit_output(ed, "\x1b[K", 3); // Clear what is left of the old text
+        }
+    }
+    edit_move_cursor(ed, ed->pos - offset);
+    ed->stale = 0;
 
-        if (pipe(pipe_fd) == -1) {
-            printf("Invalid Command\n");
+    if (visible_len > ed->shown_cap || ed->shown == NULL) {
+        char *grown = realloc(ed->shown, width);
+        if (grown == NULL) {
+            ed->shown_len = 0;
+            ed->stale = 1;
+            edit_flush(ed);
             return;
         }
+        ed->shown = grown;
+        ed->shown_cap = width;
+    }
+    memcpy(ed->shown, visible, visible_len);
+    ed->shown_len = visible_len;
+    edit_flush(ed);
+}
 
-        if (fork() == 0) {
-            dup2(in_fd, STDIN_FILENO); // Set input for the child process
-            dup2(pipe_fd[1], STDOUT_FILENO); // Set output for the child process
-            close(pipe_fd[0]);
+// Make room for n more bytes and a terminator in the line
+int edit_reserve(line_editor *ed, size_t n) {
+    if (ed->len + n + 1 <= *ed->cap) {
+        return 0;
+    }
+    size_t cap = *ed->cap > 0 ? *ed->cap : INITIAL_CMD_SIZE;
+    while (cap < ed->len + n + 1) {
+        cap *= 2;
+    }
+    char *grown = realloc(*ed->buf, cap);
+    if (grown == NULL) {
+        return -1;
+    }
+    *ed->buf = grown;
+    *ed->cap = cap;
+    return 0;
+}
 
-            // Parse and execute the command before the pipe
-            args = malloc(args_size * sizeof(char *));
-            args_count = 0;
-
-            args[args_count++] = strtok(cmd, " \n");
-            while ((args[args_count++] = strtok(NULL, " \n")) != NULL) {
-                if (args_count >= args_size) {
-                    args_size *= 2;
-                    args = realloc(args, args_size * sizeof(char *));
-                    if (args == NULL) {
-                        printf("Invalid Command\n");
-                        exit(EXIT_FAILURE);
-                    }
-                }
-            }
-            args[args_count - 1] = NULL; // Null-terminate the arguments
+// Insert text at the cursor and move past it
+void edit_insert(line_editor *ed, const char *text, size_t n) {
+    if (edit_reserve(ed, n) != 0) {
+        return;
+    }
+    char *line = *ed->buf;
+    memmove(line + ed->pos + n, line + ed->pos, ed->len - ed->pos);
+    memcpy(line + ed->pos, text, n);
+    ed->len += n;
+    ed->pos += n;
+}
 
-            if (strcmp(args[0], "history") == 0) {
-                // Handle 'history' command with output to pipe
-                print_history();
-                exit(EXIT_SUCCESS);
-            }
+// Delete the bytes in [from, to) and leave the cursor at from
+void edit_delete(line_editor *ed, size_t from, size_t to) {
+    char *line = *ed->buf;
+    memmove(line + from, line + to, ed->len - to);
+    ed->len -= to - from;
+    ed->pos = from;
+}
 
-            execvp(args[0], args);
-            printf("Invalid Command\n");
-            exit(EXIT_FAILURE);
+// Put history entry index on the line (history_count brings back the new line)
+void edit_show_history(line_editor *ed, int index) {
+    if (ed->recall == history_count) {
+        free(ed->draft);
+        ed->draft = strndup(*ed->buf, ed->len);
+    }
+    ed->recall = index;
+    const char *text = index < history_count ? history_at(index) : ed->draft != NULL ? ed->draft : "";
+    ed->len = 0;
+    ed->pos = 0;
+    edit_insert(ed, text, strlen(text));
+}
+
+// Read one byte from the terminal; 0 when it has gone away
+int edit_read(unsigned char *c) {
+    while (1) {
+        ssize_t n = read(STDIN_FILENO, c, 1);
+        if (n == 1) {
+            return 1;
+        }
+        if (n == 0 || errno != EINTR) {
+            return 0;
         }
+    }
+}
 
-        close(pipe_fd[1]); // Close write end of the pipe in the parent
-        wait(&status); // Wait for the child process to finish
-        in_fd = pipe_fd[0]; // Set up input for the next command
-        cmd = pipe_pos + 1; // Move to the next part of the command
-        pipe_pos = strchr(cmd, '|'); // Check for additional pipes
+// Decode the escape sequence after an ESC into an edit_key: "ESC [ params final"
+// or "ESC O final". Unknown sequences are read to the end and give EDIT_NONE.
+int read_escape(void) {
+    unsigned char c;
+    if (!edit_read(&c)) {
+        return -1;
+    }
+    if (c == 'O') {
+        if (!edit_read(&c)) {
+            return -1;
+        }
+        return c == 'H' ? EDIT_HOME : c == 'F' ? EDIT_END : EDIT_NONE;
+    }
+    if (c != '[') {
+        return EDIT_NONE; // Alt with a key
+    }
+    int number = 0;
+    int first_param = 1;
+    while (1) {
+        if (!edit_read(&c)) {
+            return -1;
+        }
+        if (c >= '0' && c <= '9' && first_param) {
+            number = number * 10 + (c - '0');
+        } else if (c == ';') {
+            first_param = 0; // Modifiers follow; Ctrl-Left still moves left
+        } else if (c >= 0x40 && c <= 0x7e) {
+            break;
+        }
+    }
+    switch (c) {
+    case 'A': return EDIT_UP;
+    case 'B': return EDIT_DOWN;
+    case 'C': return EDIT_RIGHT;
+    case 'D': return EDIT_LEFT;
+    case 'H': return EDIT_HOME;
+    case 'F': return EDIT_END;
+    case '~':
+        if (number == 1 || number == 7) {
+            return EDIT_HOME;
+        } else if (number == 4 || number == 8) {
+            return EDIT_END;
+        } else if (number == 3) {
+            return EDIT_DELETE;
+        }
+        return EDIT_NONE;
+    default: return EDIT_NONE;
     }
+}
 
-    // Execute the last command
-    args = malloc(args_size * sizeof(char *));
-    args_count = 0;
+// Ctrl-R: search history backwards for what is typed, showing the newest match.
+// Ctrl-R again steps to an older match, Ctrl-G or Ctrl-C gives the line back as
+// it was, and any other key takes the match onto the line and is then handled
+// as usual. Returns that key, EDIT_NONE, or -1 when the terminal goes away.
+int edit_search(line_editor *ed) {
+    char pattern[256] = "";
+    size_t pattern_len = 0;
+    int match = -1;
+    int failed = 0;
+    while (1) {
+        char head[300];
+        int head_len = snprintf(head, sizeof(head), "(%sreverse-i-search)`%s': ", failed ? "failed " : "", pattern);
+        const char *found = match >= 0 ? history_at(match) : "";
+        size_t room = ed->columns > 1 ? ed->columns - 1 : 1;
+        size_t shown = (size_t)head_len < room ? (size_t)head_len : room;
+        edit_output(ed, "\r", 1);
+        edit_output(ed, head, shown);
+        size_t found_len = strlen(found);
+        edit_output(ed, found, found_len < room - shown ? found_len : room - shown);
+        edit_output(ed, "\x1b[K", 3);
+        edit_flush(ed);
+        ed->stale = 1; // The prompt is gone until the line is redrawn
 
-    args[args_count++] = strtok(cmd, " \n");
-    while ((args[args_count++] = strtok(NULL, " \n")) != NULL) {
-        if (args_count >= args_size) {
-            args_size *= 2;
-            args = realloc(args, args_size * sizeof(char *));
-            if (args == NULL) {
-                printf("Invalid Command\n");
-                free(args);
-                return;
+        unsigned char c;
+        if (!edit_read(&c)) {
+            return -1;
+        }
+        int from;
+        if (c == 18) { // Ctrl-R: the next older match
+            from = match >= 0 ? match : history_count;
+        } else if (c == 127 || c == 8) {
+            if (pattern_len > 0) {
+                pattern[--pattern_len] = '\0';
             }
+            from = history_count;
+            match = -1;
+        } else if (c >= 32 && pattern_len < sizeof(pattern) - 1) {
+            pattern[pattern_len++] = (char)c;
+            pattern[pattern_len] = '\0';
+            from = match >= 0 ? match + 1 : history_count; // The current match may still do
+        } else if (c == 7 || c == 3) {
+            return EDIT_NONE;
+        } else {
+            if (match >= 0) {
+                edit_show_history(ed, match);
+            }
+            return c;
+        }
+        int older = pattern_len > 0 ? find_history_match(pattern, from) : -1;
+        failed = pattern_len > 0 && older < 0;
+        if (older >= 0) {
+            match = older;
         }
     }
-    args[args_count - 1] = NULL; // Null-terminate the arguments
+}
 
-    if (strcmp(args[0], "cd") == 0) {
-        // Handle 'cd' command
-        char current_dir[INITIAL_CMD_SIZE];
-        if (getcwd(current_dir, sizeof(current_dir)) == NULL) {
-            printf("Invalid Command\n");
-            free(args);
-            return;
+// Tab completion works from snapshots of directories: the names read once with
+// getdents64 and sorted, so the candidates for a prefix are a binary search and
+// a contiguous run. A directory's mtime moves whenever an entry is added, removed
+// or renamed, so a snapshot is read again only when a stat of the directory
+// shows a different one. Like git's index, a snapshot taken in the same second
+// as the mtime it saw can't be trusted to catch a later change in that second,
+// and is read again on its next use.
+typedef struct {
+    char *path;             // Directory as it was named
+    dev_t dev;              // Identity and mtime of the directory when it was read
+    ino_t ino;
+    struct timespec mtime;
+    int racy;               // Read in the second of its mtime: read it again next time
+    char *names;            // The names back to back, NUL-terminated; directories end in '/'
+    ls_entry *entries;      // The names in strcmp order
+    size_t count;
+} name_snapshot;
+
+name_snapshot *path_snapshots = NULL; // One per PATH entry, for command names
+size_t path_snapshot_count = 0;
+char *path_snapshot_env = NULL;       // Value of PATH the snapshots follow
+ls_entry *command_index = NULL;       // Builtins and every PATH snapshot merged, in order
+size_t command_index_count = 0;
+name_snapshot file_snapshot;          // The directory file names were last completed in
+
+void free_name_snapshot(name_snapshot *snap) {
+    free(snap->path);
+    free(snap->names);
+    free(snap->entries);
+    memset(snap, 0, sizeof(*snap));
+}
+
+// Bring a snapshot of path up to date; executables keeps only the executable
+// regular files, as command names. Returns 1 if it was read again, else 0.
+// A directory that can't be read leaves an empty snapshot.
+int update_name_snapshot(name_snapshot *snap, const char *path, int executables) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        int had_names = snap->count > 0;
+        free_name_snapshot(snap);
+        return had_names;
+    }
+    if (snap->path != NULL && !snap->racy && strcmp(snap->path, path) == 0 && snap->dev == st.st_dev &&
+        snap->ino == st.st_ino && snap->mtime.tv_sec == st.st_mtim.tv_sec &&
+        snap->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        return 0;
+    }
+    free_name_snapshot(snap);
+    snap->path = strdup(path);
+    snap->dev = st.st_dev;
+    snap->ino = st.st_ino;
+    snap->mtime = st.st_mtim; // Taken before reading, so a change while we read shows next time
+    snap->racy = time(NULL) <= st.st_mtim.tv_sec;
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char *buffer = malloc(LS_BUFFER_SIZE);
+    if (snap->path == NULL || dir_fd == -1 || buffer == NULL) {
+        if (dir_fd != -1) {
+            close(dir_fd);
         }
+        free(buffer);
+        return 1;
+    }
 
-        if (args[1] == NULL || strcmp(args[1], "~") == 0) {
-            char *home_dir = getenv("HOME");
-            if (home_dir) {
-                if (chdir(home_dir) != 0) {
-                    printf("Invalid Command\n");
-                } else {
-                    strncpy(prev_dir, current_dir, sizeof(prev_dir)); // Update previous directory
+    // Names are packed first and the entries pointed at them once the block stops moving
+    size_t used = 0, size = 0, count = 0;
+    ssize_t n;
+    while ((n = getdents64(dir_fd, buffer, LS_BUFFER_SIZE)) > 0) {
+        for (ssize_t offset = 0; offset < n;) {
+            struct dirent64 *d = (struct dirent64 *)(buffer + offset);
+            offset += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            int directory = d->d_type == DT_DIR;
+            if (executables || d->d_type == DT_UNKNOWN || d->d_type == DT_LNK) {
+                struct stat entry;
+                int found = fstatat(dir_fd, name, &entry, 0) == 0; // A dangling link is still a file name
+                if (executables && !(found && S_ISREG(entry.st_mode) && (entry.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)))) {
+                    continue;
                 }
-            } else {
-                printf("Invalid Command\n");
+                directory = !executables && found && S_ISDIR(entry.st_mode);
             }
-        } else if (strcmp(args[1], "-") == 0) {
-            if (strlen(prev_dir) == 0) {
-                // Do nothing if OLDPWD is not set
-            } else {
-                if (chdir(prev_dir) == 0) {
-                    // On success, print the previous directory
-                    printf("%s\n", prev_dir);
-                    strncpy(prev_dir, current_dir, sizeof(prev_dir)); // Update previous directory
-                } else {
-                    printf("Invalid Command\n");
+            size_t len = strlen(name);
+            if (used + len + 2 > size) {
+                size_t grown_size = size > 0 ? size * 2 : 4096;
+                while (used + len + 2 > grown_size) {
+                    grown_size *= 2;
                 }
+                char *grown = realloc(snap->names, grown_size);
+                if (grown == NULL) {
+                    continue;
+                }
+                snap->names = grown;
+                size = grown_size;
             }
-        } else {
-            if (chdir(args[1]) != 0) {
-                printf("Invalid Command\n");
-            } else {
-                strncpy(prev_dir, current_dir, sizeof(prev_dir)); // Update previous directory
+            memcpy(snap->names + used, name, len);
+            used += len;
+            if (directory) {
+                snap->names[used++] = '/';
             }
+            snap->names[used++] = '\0';
+            count++;
         }
-    } else if (strcmp(args[0], "history") == 0) {
-        // Handle 'history' command
-        if (in_fd != 0) {
-            // Output to pipe
-            print_history();
-            fflush(stdout);
-        } else {
-            print_history();
-        }
-    } else if (strcmp(args[0], "cat") == 0) {
-        // Handle 'cat' command
-        if (args[1] == NULL) {
-            printf("Invalid Command\n");
-            free(args);
-            return;
-        }
+    }
+    close(dir_fd);
+    free(buffer);
 
-        FILE *file = fopen(args[1], "r");
-        if (file == NULL) {
-            perror("cat"); // Print the standard error message
-            free(args);
-            return;
+    snap->entries = count > 0 ? malloc(count * sizeof(ls_entry)) : NULL;
+    if (snap->entries != NULL) {
+        const char *name = snap->names;
+        for (size_t i = 0; i < count; i++) {
+            snap->entries[i].key = ls_name_key(name);
+            snap->entries[i].name = name;
+            snap->entries[i].st = NULL;
+            name += strlen(name) + 1;
         }
+        snap->count = count;
+        ls_options by_name;
+        memset(&by_name, 0, sizeof(by_name));
+        qsort_r(snap->entries, count, sizeof(ls_entry), compare_ls_entries, &by_name);
+    }
+    return 1;
+}
 
-        char ch;
-        while ((ch = fgetc(file)) != EOF) {
-            putchar(ch);
+// Bring the PATH snapshots up to date and, if any changed, merge them with the
+// builtins into command_index
+void update_command_index(void) {
+    const char *path_env = getenv("PATH");
+    if (path_env == NULL) {
+        path_env = "/usr/local/bin:/usr/bin:/bin";
+    }
+    int changed = command_index == NULL;
+    if (path_snapshot_env == NULL || strcmp(path_snapshot_env, path_env) != 0) {
+        for (size_t i = 0; i < path_snapshot_count; i++) {
+            free_name_snapshot(&path_snapshots[i]);
         }
-        fclose(file);
-        putchar('\n'); // Add newline after file content
-    } else if (strcmp(args[0], "dd") == 0) {
-        // Handle 'dd' command
-        if (args[1] == NULL || strncmp(args[1], "if=", 3) != 0 || args[2] == NULL || strncmp(args[2], "of=", 3) != 0) {
-            printf("Invalid Command\n");
-            free(args);
-            return;
+        free(path_snapshots);
+        free(path_snapshot_env);
+        path_snapshot_env = strdup(path_env);
+        path_snapshot_count = 1;
+        for (const char *p = path_env; *p != '\0'; p++) {
+            path_snapshot_count += *p == ':';
         }
+        path_snapshots = calloc(path_snapshot_count, sizeof(name_snapshot));
+        if (path_snapshots == NULL || path_snapshot_env == NULL) {
+            path_snapshot_count = 0;
+        }
+        changed = 1;
+    }
 
-        pid_t pid = fork();
-        if (pid == 0) {
-            // Redirect stdout and stderr to /dev/null
-            freopen("/dev/null", "w", stdout);
-            freopen("/dev/null", "w", stderr);
-
-            // Execute the dd command
-            execvp(args[0], args);
+    const char *dir = path_env;
+    for (size_t i = 0; i < path_snapshot_count; i++) {
+        const char *end = strchr(dir, ':');
+        size_t dir_len = end ? (size_t)(end - dir) : strlen(dir);
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%.*s", dir_len > 0 ? (int)dir_len : 1, dir_len > 0 ? dir : "."); // Empty means "."
+        changed |= update_name_snapshot(&path_snapshots[i], path, 1);
+        dir = end != NULL ? end + 1 : dir + dir_len;
+    }
+    if (!changed) {
+        return;
+    }
 
-            // If execvp fails, print error and exit
-            printf("Invalid Command\n");
-            exit(EXIT_FAILURE);
-        } else if (pid > 0) {
-            waitpid(pid, &status, 0);
-            // Check if the child process exited with an error
-            if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
-                printf("Invalid Command\n");
-            }
-        } else {
-            printf("Invalid Command\n");
+    size_t total = BUILTIN_SLOTS;
+    for (size_t i = 0; i < path_snapshot_count; i++) {
+        total += path_snapshots[i].count;
+    }
+    free(command_index);
+    command_index_count = 0;
+    command_index = malloc(total * sizeof(ls_entry));
+    if (command_index == NULL) {
+        return;
+    }
+    for (int i = 0; i < BUILTIN_SLOTS; i++) {
+        if (builtins[i].name != NULL) {
+            ls_entry *e = &command_index[command_index_count++];
+            e->key = ls_name_key(builtins[i].name);
+            e->name = builtins[i].name;
+            e->st = NULL;
         }
-    } else if (strcmp(args[0], "grep") == 0) {
-        // Handle 'grep' command
-        if (args[1] == NULL) {
-            // grep needs at least one pattern and one file or input
-            printf("Invalid Command\n");
-            free(args);
-            return;
+    }
+    for (size_t i = 0; i < path_snapshot_count; i++) {
+        if (path_snapshots[i].count > 0) {
+            memcpy(command_index + command_index_count, path_snapshots[i].entries,
+                   path_snapshots[i].count * sizeof(ls_entry));
+            command_index_count += path_snapshots[i].count;
         }
-
-        pid_t pid = fork();
-        if (pid == 0) {
-            dup2(in_fd, STDIN_FILENO); // Final input redirection
-            execvp(args[0], args);
-            printf("Invalid Command\n");
-            exit(EXIT_FAILURE);
-        } else if (pid > 0) {
-            close(in_fd); // Close the pipe's input side in the parent
-            waitpid(pid, &status, 0);
-            // Check if the child process exited with an error
-            if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
-                // If grep exits with status 1 (no matches), don't print "Invalid Command"
-                if (WEXITSTATUS(status) != 1) {
-                    printf("Invalid Command\n");
-                }
-            }
-        } else {
-            printf("Invalid Command\n");
+    }
+    ls_options by_name;
+    memset(&by_name, 0, sizeof(by_name));
+    qsort_r(command_index, command_index_count, sizeof(ls_entry), compare_ls_entries, &by_name);
+    size_t unique = command_index_count > 0; // The same name in several directories is one command
+    for (size_t i = 1; i < command_index_count; i++) {
+        if (strcmp(command_index[i].name, command_index[unique - 1].name) != 0) {
+            command_index[unique++] = command_index[i];
         }
-    } else if (strcmp(args[0], "ls") == 0) {
-        // Handle 'ls' command
-        int stderr_fd[2];
-        pipe(stderr_fd);
-        pid_t pid = fork();
-        if (pid == 0) {
-            dup2(in_fd, STDIN_FILENO); // Final input redirection
-            dup2(stderr_fd[1], STDERR_FILENO); // Redirect stderr to pipe
-            close(stderr_fd[0]);
+    }
+    command_index_count = unique;
+}
 
-            execvp(args[0], args);
+void free_completion_index(void) {
+    for (size_t i = 0; i < path_snapshot_count; i++) {
+        free_name_snapshot(&path_snapshots[i]);
+    }
+    free(path_snapshots);
+    free(path_snapshot_env);
+    free(command_index);
+    free_name_snapshot(&file_snapshot);
+}
 
-            // If execvp fails, print error and exit
-            printf("Invalid Command\n");
-            exit(EXIT_FAILURE);
-        } else if (pid > 0) {
-            close(stderr_fd[1]);
-            char error_buffer[1024];
-            ssize_t len = read(stderr_fd[0], error_buffer, sizeof(error_buffer) - 1);
-            error_buffer[len] = '\0';
+// The run of sorted entries whose names start with prefix: its start, and its
+// length through *count
+ls_entry *find_prefix_run(ls_entry *entries, size_t total, const char *prefix, size_t *count) {
+    size_t low = 0, high = total;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strcmp(entries[mid].name, prefix) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    size_t prefix_len = strlen(prefix);
+    size_t end = low;
+    while (end < total && strncmp(entries[end].name, prefix, prefix_len) == 0) {
+        end++;
+    }
+    *count = end - low;
+    return entries + low;
+}
 
-            waitpid(pid, &status, 0);
+// Tab completion candidates, in order; the names belong to the snapshots
+typedef struct {
+    const char **names;
+    size_t count;
+    size_t cap;
+} completion_list;
 
-            // Check if the child process exited with an error
-            if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
-                printf("Invalid Command\n");
-            } else if (strlen(error_buffer) > 0) {
-                printf("Invalid Command\n");
-            }
-        } else {
-            printf("Invalid Command\n");
+void add_completion(completion_list *list, const char *name) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap > 0 ? list->cap * 2 : 64;
+        const char **grown = realloc(list->names, cap * sizeof(char *));
+        if (grown == NULL) {
+            return;
         }
+        list->names = grown;
+        list->cap = cap;
+    }
+    list->names[list->count++] = name;
+}
+
+// Add the names in the directory part of word that start with the rest of it;
+// dot files only when that rest starts with a dot
+void complete_files(completion_list *list, const char *word) {
+    const char *slash = strrchr(word, '/');
+    const char *base = slash != NULL ? slash + 1 : word;
+    char dir[PATH_MAX];
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else if (slash == word) {
+        strcpy(dir, "/");
     } else {
-        // Handle other commands
-        pid_t pid = fork();
-        if (pid == 0) {
-            dup2(in_fd, STDIN_FILENO); // Final input redirection
-            execvp(args[0], args);
-            printf("Invalid Command\n");
-            exit(EXIT_FAILURE);
-        } else if (pid > 0) {
-            waitpid(pid, &status, 0);
-            // Check if the child process was stopped
-            if (WIFSTOPPED(status)) {
-                printf("Invalid Command\n");
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - word), word);
+    }
+    update_name_snapshot(&file_snapshot, dir, 0);
+    size_t count;
+    ls_entry *run = find_prefix_run(file_snapshot.entries, file_snapshot.count, base, &count);
+    for (size_t i = 0; i < count; i++) {
+        if (run[i].name[0] != '.' || base[0] == '.') {
+            add_completion(list, run[i].name);
+        }
+    }
+}
+
+// Add the builtins and the executables on PATH that start with prefix
+void complete_commands(completion_list *list, const char *prefix) {
+    update_command_index();
+    size_t count;
+    ls_entry *run = find_prefix_run(command_index, command_index_count, prefix, &count);
+    for (size_t i = 0; i < count; i++) {
+        add_completion(list, run[i].name);
+    }
+}
+
+// Queue the candidates down columns under the line, as ls lays out names
+void edit_list_completions(line_editor *ed, completion_list *list) {
+    size_t widest = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        size_t len = strlen(list->names[i]);
+        widest = len > widest ? len : widest;
+    }
+    size_t per_row = ed->columns / (widest + 2);
+    per_row = per_row > 0 ? per_row : 1;
+    size_t rows = (list->count + per_row - 1) / per_row;
+    edit_output(ed, "\n", 1);
+    for (size_t row = 0; row < rows; row++) {
+        for (size_t i = row; i < list->count; i += rows) {
+            size_t len = strlen(list->names[i]);
+            edit_output(ed, list->names[i], len);
+            if (i + rows < list->count) {
+                for (size_t pad = len; pad < widest + 2; pad++) {
+                    edit_output(ed, " ", 1);
+                }
             }
-        } else {
-            printf("Invalid Command\n");
         }
+        edit_output(ed, "\n", 1);
     }
-    free(args); // Free allocated memory for arguments
+    ed->stale = 1; // The prompt goes again under the list
 }
 
-// Remove leading and trailing spaces from a string
-void trim_spaces(char *str) {
-    if (str == NULL || *str == '\0') {
+// Tab: complete the word before the cursor as far as it is unambiguous, with a
+// space after a single match. The first word of a command completes to builtins
+// and commands on PATH, anything else (or a word with a '/') to file names. A
+// second Tab that can add nothing lists the candidates.
+void edit_complete(line_editor *ed, int repeated) {
+    const char *line = *ed->buf;
+    size_t start = ed->pos;
+    while (start > 0 && strchr(" \t|&;<>()", line[start - 1]) == NULL) {
+        start--;
+    }
+    size_t before = start;
+    while (before > 0 && line[before - 1] == ' ') {
+        before--;
+    }
+    int command_word = before == 0 || strchr("|&;(", line[before - 1]) != NULL;
+    char *word = strndup(line + start, ed->pos - start);
+    if (word == NULL) {
         return;
     }
 
-    // Remove leading spaces
-    char *start = str;
-    while (*start == ' ') {
-        start++;
+    completion_list list = { NULL, 0, 0 };
+    if (command_word && strchr(word, '/') == NULL) {
+        complete_commands(&list, word);
+    } else {
+        complete_files(&list, word);
     }
+    const char *slash = strrchr(word, '/');
+    size_t base_len = strlen(slash != NULL ? slash + 1 : word);
 
-    // If the string is only spaces, return empty
-    if (*start == '\0') {
-        *str = '\0';
-        return;
+    if (list.count == 0) {
+        edit_output(ed, "\a", 1);
+    } else {
+        // In order, so the first and last names bound the common prefix
+        const char *first = list.names[0];
+        const char *last = list.names[list.count - 1];
+        size_t common = 0;
+        while (first[common] != '\0' && first[common] == last[common]) {
+            common++;
+        }
+        if (common > base_len) {
+            edit_insert(ed, first + base_len, common - base_len);
+        }
+        if (list.count == 1 && first[common - 1] != '/') {
+            edit_insert(ed, " ", 1);
+        } else if (list.count > 1 && common == base_len) {
+            if (repeated) {
+                edit_list_completions(ed, &list);
+            } else {
+                edit_output(ed, "\a", 1);
+            }
+        }
     }
+    free(list.names);
+    free(word);
+}
 
-    // Remove trailing spaces
-    char *end = start + strlen(start) - 1;
-    while (end > start && *end == ' ') {
-        end--;
+// Read a line at the prompt with editing. Returns its length as getline does, or
+// -1 for Ctrl-D on an empty line or a terminal that has gone away. Ctrl-C drops
+// the line and returns an empty one.
+ssize_t edit_line(const char *prompt, char **buf, size_t *cap) {
+    struct termios cooked;
+    if (tcgetattr(STDIN_FILENO, &cooked) != 0) {
+        out_write(prompt, strlen(prompt));
+        flush_output();
+        return getline(buf, cap, stdin);
     }
+    struct termios raw = cooked;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw); // Not TCSAFLUSH: keystrokes typed ahead are kept
 
-    // Null terminate the string after the last non-space character
-    *(end + 1) = '\0';
+    line_editor ed;
+    memset(&ed, 0, sizeof(ed));
+    ed.buf = buf;
+    ed.cap = cap;
+    ed.prompt = prompt;
+    ed.prompt_len = strlen(prompt);
+    ed.recall = history_count;
+    ed.stale = 1;
+    ssize_t result = -1;
+    if (edit_reserve(&ed, 0) != 0) {
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+        return -1;
+    }
+    edit_refresh(&ed);
 
-    // Move trimmed string to the beginning
-    if (start != str) {
-        memmove(str, start, strlen(start) + 1);
+    int previous = 0;
+    while (1) {
+        unsigned char c;
+        if (!edit_read(&c)) {
+            break;
+        }
+        int key = c;
+        if (key == 18) {
+            key = edit_search(&ed);
+        }
+        if (key == 27) {
+            key = read_escape();
+        }
+        if (key < 0) {
+            break;
+        }
+        char *line = *ed.buf;
+        if (key == '\r' || key == '\n') {
+            result = (ssize_t)ed.len;
+            break;
+        } else if (key == 3) { // Ctrl-C
+            edit_output(&ed, "^C", 2);
+            ed.len = 0;
+            result = 0;
+            last_status = 128 + SIGINT;
+            break;
+        } else if (key == 4 && ed.len == 0) { // Ctrl-D on an empty line
+            break;
+        } else if (key == 4 || key == EDIT_DELETE) {
+            if (ed.pos < ed.len) {
+                edit_delete(&ed, ed.pos, ed.pos + 1);
+            }
+        } else if (key == 127 || key == 8) { // Backspace, Ctrl-H
+            if (ed.pos > 0) {
+                edit_delete(&ed, ed.pos - 1, ed.pos);
+            }
+        } else if (key == 1 || key == EDIT_HOME) { // Ctrl-A
+            ed.pos = 0;
+        } else if (key == 5 || key == EDIT_END) { // Ctrl-E
+            ed.pos = ed.len;
+        } else if (key == 2 || key == EDIT_LEFT) { // Ctrl-B
+            ed.pos -= ed.pos > 0;
+        } else if (key == 6 || key == EDIT_RIGHT) { // Ctrl-F
+            ed.pos += ed.pos < ed.len;
+        } else if (key == 16 || key == EDIT_UP) { // Ctrl-P
+            if (ed.recall > 0) {
+                edit_show_history(&ed, ed.recall - 1);
+            }
+        } else if (key == 14 || key == EDIT_DOWN) { // Ctrl-N
+            if (ed.recall < history_count) {
+                edit_show_history(&ed, ed.recall + 1);
+            }
+        } else if (key == 11) { // Ctrl-K: kill to the end
+            edit_delete(&ed, ed.pos, ed.len);
+        } else if (key == 21) { // Ctrl-U: kill to the start
+            edit_delete(&ed, 0, ed.pos);
+        } else if (key == 23) { // Ctrl-W: kill the word before the cursor
+            size_t from = ed.pos;
+            while (from > 0 && line[from - 1] == ' ') {
+                from--;
+            }
+            while (from > 0 && line[from - 1] != ' ') {
+                from--;
+            }
+            edit_delete(&ed, from, ed.pos);
+        } else if (key == 20 && ed.pos > 0 && ed.len > 1) { // Ctrl-T: swap the two characters at the cursor
+            size_t at = ed.pos < ed.len ? ed.pos : ed.len - 1;
+            char swap = line[at - 1];
+            line[at - 1] = line[at];
+            line[at] = swap;
+            ed.pos = at + 1;
+        } else if (key == 12) { // Ctrl-L
+            edit_output(&ed, "\x1b[H\x1b[2J", 7);
+            ed.stale = 1;
+        } else if (key == '\t') {
+            edit_complete(&ed, previous == '\t');
+        } else if (key >= 32 && key < 256) {
+            char byte = (char)key;
+            edit_insert(&ed, &byte, 1);
+        }
+        previous = key;
+        edit_refresh(&ed);
+    }
+
+    if (*ed.buf != NULL) {
+        (*ed.buf)[ed.len] = '\0';
     }
+    edit_output(&ed, "\n", 1); // The command's output starts on a line of its own
+    edit_flush(&ed);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+    free(ed.shown);
+    free(ed.out);
+    free(ed.draft);
+    return result;
 }
 
-int main() {
+int main(int argc, char **argv) {
     char *cmd = NULL;
     size_t cmd_size = 0;
 
-    // Initialize history
-    history_size = 100;
-    history = malloc(history_size * sizeof(char *));
-    if (history == NULL) {
-        printf("Invalid Command\n");
-        exit(EXIT_FAILURE);
+    // Batch mode: -c runs one command line, -s reads commands from a script, and
+    // stdin that isn't a terminal is read the same way, with no prompt.
+    // --trace=file traces the session to file, as 'set -o trace' does.
+    FILE *input = stdin;
+    char *command_string = NULL;
+    atexit(flush_output); // Output still buffered when the shell exits
+    shell_pid = getpid();
+    shell_name = argv[0];
+    import_environment();
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--trace=", 8) == 0 && argv[i][8] != '\0') {
+            if (start_trace(argv[i] + 8) != 0) {
+                out_printf("Invalid Command\n");
+                return 2;
+            }
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc && command_string == NULL) {
+            command_string = argv[++i];
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc && input == stdin) {
+            input = fopen(argv[++i], "re");
+            if (input == NULL) {
+                out_printf("Invalid Command\n");
+                return 127;
+            }
+        } else {
+            out_printf("Invalid Command\n");
+            return 2;
+        }
     }
+    int interactive = command_string == NULL && input == stdin && isatty(STDIN_FILENO);
+    // The prompt gets line editing when it is drawn on a terminal that can take it
+    const char *term = getenv("TERM");
+    int editing = interactive && isatty(STDOUT_FILENO) && term != NULL && strcmp(term, "dumb") != 0;
 
-    while (1) {
-        printf("MTL458 > ");
-        fflush(stdout);
+    // Initialize history with room for HISTSIZE commands
+    int histsize = DEFAULT_HISTSIZE;
+    char *histsize_env = getenv("HISTSIZE");
+    if (histsize_env != NULL && *histsize_env != '\0') {
+        char *end;
+        long value = strtol(histsize_env, &end, 10);
+        if (*end == '\0' && value >= 0 && value <= 1000000000) {
+            histsize = (int)value;
+        }
+    }
+    init_history(histsize);
+
+    // Pick up earlier sessions from HISTFILE (an empty HISTFILE disables it); like
+    // other shells, scripts keep their history to themselves
+    char *histfile = getenv("HISTFILE");
+    char *home_dir = getenv("HOME");
+    if (interactive && histfile != NULL) {
+        if (*histfile != '\0') {
+            load_history_file(histfile);
+        }
+    } else if (interactive && home_dir != NULL) {
+        char histfile_path[INITIAL_CMD_SIZE];
+        snprintf(histfile_path, sizeof(histfile_path), "%s/%s", home_dir, DEFAULT_HISTFILE);
+        load_history_file(histfile_path);
+    }
+
+    // Job control when stdin is a terminal: wait to be in the foreground, then take
+    // a process group of our own and leave the stop signals to the jobs
+    if (interactive) {
+        while (tcgetpgrp(STDIN_FILENO) != getpgrp()) {
+            kill(-getpgrp(), SIGTTIN);
+        }
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+        setpgid(0, 0); // Fails harmlessly when we already lead a session
+        shell_pgid = getpgrp();
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        shell_interactive = 1;
+    }
+    struct sigaction child_action;
+    memset(&child_action, 0, sizeof(child_action));
+    child_action.sa_handler = note_child_change;
+    sigemptyset(&child_action.sa_mask);
+    child_action.sa_flags = SA_RESTART; // getline carries on; the notice waits for the next prompt
+    sigaction(SIGCHLD, &child_action, NULL);
+
+    if (command_string != NULL) {
+        run_command(command_string);
+    }
+
+    while (command_string == NULL) {
+        // Bring the job table up to date only when a child actually changed state
+        if (children_changed) {
+            reap_jobs();
+            notify_jobs();
+        }
+
+        if (interactive) {
+            flush_trace(); // While idle, so the writes don't land inside a traced command
+            if (!editing) {
+                out_printf("MTL458 > ");
+            }
+            flush_output();
+        }
 
-        ssize_t len = getline(&cmd, &cmd_size, stdin); // Read input command
+        ssize_t len;
+        if (editing) {
+            len = edit_line("MTL458 > ", &cmd, &cmd_size);
+            if (len == -1) {
+                break; // Ctrl+D, or the terminal is gone
+            }
+        } else {
+            len = getline(&cmd, &cmd_size, input); // Read input command
+        }
         if (len == -1) {
-            if (feof(stdin)) { // End-of-file (Ctrl+D) should exit
+            if (feof(input)) { // End-of-file (Ctrl+D) should exit
                 break;
             } else {
-                printf("Invalid Command\n");
+                out_printf("Invalid Command\n");
                 continue;
             }
         }
@@ -420,20 +7139,34 @@ int main() {
             continue;
         }
 
-        if (strcmp(cmd, "exit") == 0) {
+        add_to_history(cmd); // Add command to history
+        run_command(cmd); // Execute the command
+        if (exit_requested) {
             break;
         }
+    }
 
-        add_to_history(cmd); // Add command to history
-        run_command(cmd); // Execute the command
+    stop_trace();
+
+    // Free the command path cache and the completion snapshots
+    clear_command_hash();
+    free(command_hash_path);
+    free_completion_index();
+    free_variables();
+
+    // Free the job table; jobs still running carry on without us
+    while (job_count > 0) {
+        remove_job(&jobs[job_count - 1]);
     }
+    free(jobs);
 
     // Free allocated history memory
-    for (int i = 0; i < history_count; i++) {
-        free(history[i]);
-    }
-    free(history);
+    free_history();
+    arena_free(&command_arena);
     free(cmd);
+    if (input != stdin) {
+        fclose(input);
+    }
 
-    return 0;
+    return last_status;
 }
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/wait.h>
 
 #define INITIAL_ARGS_SIZE 10
@@ -100,6 +101,34 @@ void parse_arguments(char *cmd, char ***args, int *args_count, int *args_size) {
     (*args)[*args_count] = NULL; // Null-terminate the arguments array
 }
 
+// Reap every stage of a pipeline together; returns the wait status of the last stage
+int wait_pipeline(pid_t *stage_pids, int *stage_count) {
+    int status = 0;
+    for (int i = 0; i < *stage_count; i++) {
+        int stage_status;
+        while (waitpid(stage_pids[i], &stage_status, 0) == -1) {
+            if (errno != EINTR) {
+                stage_status = 0;
+                break;
+            }
+        }
+        if (i == *stage_count - 1) {
+            status = stage_status; // Pipeline status is that of the last stage, as in POSIX
+        }
+    }
+    *stage_count = 0;
+    return status;
+}
+
+// Close the pipeline's read end and reap any stages still running
+void finish_pipeline(int in_fd, pid_t *stage_pids, int *stage_count) {
+    if (in_fd != 0) {
+        close(in_fd);
+    }
+    wait_pipeline(stage_pids, stage_count);
+    free(stage_pids);
+}
+
 // Execute the given command
 void run_command(char *cmd) {
     char **args = NULL;
@@ -110,17 +139,35 @@ void run_command(char *cmd) {
     int in_fd = 0; // Input file descriptor
     int status;
 
+    // Every stage is forked up front, so keep their pids for a single reap at the end
+    int stage_total = 1;
+    for (char *p = pipe_pos; p != NULL; p = strchr(p + 1, '|')) {
+        stage_total++;
+    }
+    pid_t *stage_pids = malloc(stage_total * sizeof(pid_t));
+    int stage_count = 0;
+    if (stage_pids == NULL) {
+        printf("Invalid Command\n");
+        return;
+    }
+
     while (pipe_pos) {
         *pipe_pos = '\0'; // Split the command at the pipe
 
         if (pipe(pipe_fd) == -1) {
             printf("Invalid Command\n");
+            finish_pipeline(in_fd, stage_pids, &stage_count);
             return;
         }
 
-        if (fork() == 0) {
-            dup2(in_fd, STDIN_FILENO); // Set input for the child process
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (in_fd != 0) {
+                dup2(in_fd, STDIN_FILENO); // Set input for the child process
+                close(in_fd);
+            }
             dup2(pipe_fd[1], STDOUT_FILENO); // Set output for the child process
+            close(pipe_fd[1]);
             close(pipe_fd[0]);
 
             // Parse and execute the command before the pipe
@@ -129,16 +176,24 @@ void run_command(char *cmd) {
             if (strcmp(args[0], "history") == 0) {
                 // Handle 'history' command with output to pipe
                 print_history();
-                exit(EXIT_SUCCESS);
+                fflush(stdout);
+                _exit(EXIT_SUCCESS); // _exit so the shared stdin buffer isn't rewound by the child
             }
 
             execvp(args[0], args);
             printf("Invalid Command\n");
-            exit(EXIT_FAILURE);
+            fflush(stdout);
+            _exit(EXIT_FAILURE);
+        } else if (pid > 0) {
+            stage_pids[stage_count++] = pid; // Don't wait: the next stage must start reading now
+        } else {
+            printf("Invalid Command\n");
         }
 
         close(pipe_fd[1]); // Close write end of the pipe in the parent
-        wait(&status); // Wait for the child process to finish
+        if (in_fd != 0) {
+            close(in_fd); // The stage just forked owns the previous read end now
+        }
         in_fd = pipe_fd[0]; // Set up input for the next command
         cmd = pipe_pos + 1; // Move to the next part of the command
         pipe_pos = strchr(cmd, '|'); // Check for additional pipes
@@ -153,6 +208,7 @@ void run_command(char *cmd) {
         if (getcwd(current_dir, sizeof(current_dir)) == NULL) {
             printf("Invalid Command\n");
             free(args);
+            finish_pipeline(in_fd, stage_pids, &stage_count);
             return;
         }
 
@@ -200,6 +256,7 @@ void run_command(char *cmd) {
         if (args[1] == NULL) {
             printf("Invalid Command\n");
             free(args);
+            finish_pipeline(in_fd, stage_pids, &stage_count);
             return;
         }
 
@@ -207,6 +264,7 @@ void run_command(char *cmd) {
         if (file == NULL) {
             perror("cat"); // Print the standard error message
             free(args);
+            finish_pipeline(in_fd, stage_pids, &stage_count);
             return;
         }
 
@@ -221,6 +279,7 @@ void run_command(char *cmd) {
         if (args[1] == NULL || strncmp(args[1], "if=", 3) != 0 || args[2] == NULL || strncmp(args[2], "of=", 3) != 0) {
             printf("Invalid Command\n");
             free(args);
+            finish_pipeline(in_fd, stage_pids, &stage_count);
             return;
         }
 
@@ -237,7 +296,12 @@ void run_command(char *cmd) {
             printf("Invalid Command\n");
             exit(EXIT_FAILURE);
         } else if (pid > 0) {
-            waitpid(pid, &status, 0);
+            stage_pids[stage_count++] = pid;
+            if (in_fd != 0) {
+                close(in_fd);
+                in_fd = 0;
+            }
+            status = wait_pipeline(stage_pids, &stage_count);
             // Check if the child process exited with an error
             if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
                 printf("Invalid Command\n");
@@ -251,6 +315,7 @@ void run_command(char *cmd) {
             // grep needs at least one pattern and one file or input
             printf("Invalid Command\n");
             free(args);
+            finish_pipeline(in_fd, stage_pids, &stage_count);
             return;
         }
 
@@ -261,8 +326,12 @@ void run_command(char *cmd) {
             printf("Invalid Command\n");
             exit(EXIT_FAILURE);
         } else if (pid > 0) {
-            close(in_fd); // Close the pipe's input side in the parent
-            waitpid(pid, &status, 0);
+            stage_pids[stage_count++] = pid;
+            if (in_fd != 0) {
+                close(in_fd); // Close the pipe's input side in the parent
+                in_fd = 0;
+            }
+            status = wait_pipeline(stage_pids, &stage_count);
             // Check if the child process exited with an error
             if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
                 // If grep exits with status 1 (no matches), don't print "Invalid Command"
@@ -289,12 +358,18 @@ void run_command(char *cmd) {
             printf("Invalid Command\n");
             exit(EXIT_FAILURE);
         } else if (pid > 0) {
+            stage_pids[stage_count++] = pid;
+            if (in_fd != 0) {
+                close(in_fd);
+                in_fd = 0;
+            }
             close(stderr_fd[1]);
             char error_buffer[1024];
             ssize_t len = read(stderr_fd[0], error_buffer, sizeof(error_buffer) - 1);
             error_buffer[len] = '\0';
+            close(stderr_fd[0]);
 
-            waitpid(pid, &status, 0);
+            status = wait_pipeline(stage_pids, &stage_count);
 
             // Check if the child process exited with an error
             if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
@@ -314,7 +389,12 @@ void run_command(char *cmd) {
             printf("Invalid Command\n");
             exit(EXIT_FAILURE);
         } else if (pid > 0) {
-            waitpid(pid, &status, 0);
+            stage_pids[stage_count++] = pid;
+            if (in_fd != 0) {
+                close(in_fd);
+                in_fd = 0;
+            }
+            status = wait_pipeline(stage_pids, &stage_count);
             // Check if the child process was stopped
             if (WIFSTOPPED(status)) {
                 printf("Invalid Command\n");
@@ -323,6 +403,8 @@ void run_command(char *cmd) {
             printf("Invalid Command\n");
         }
     }
+    // Builtins in the last stage never read the pipe; drop it so upstream stages can finish
+    finish_pipeline(in_fd, stage_pids, &stage_count);
     free(args); // Free allocated memory for arguments
 }
 
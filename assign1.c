@@ -147,44 +147,59 @@ void openHelp()
     return;
 }
 
+// Builtin commands: each handler returns 1 once the command is handled
+int exitCmd(char** parsed)
+{
+    (void)parsed;
+    printf("\nGoodbye\n");
+    exit(0);
+}
+
+int cdCmd(char** parsed)
+{
+    chdir(parsed[1]);
+    return 1;
+}
+
+int helpCmd(char** parsed)
+{
+    (void)parsed;
+    openHelp();
+    return 1;
+}
+
+int helloCmd(char** parsed)
+{
+    char* username = getenv("USER");
+    (void)parsed;
+    printf("\nHello %s.\nMind that this is "
+        "not a place to play around."
+        "\nUse help to know more..\n",
+        username);
+    return 1;
+}
+
+// Dispatch table of builtin commands
+struct ownCmd {
+    const char* name;
+    int (*handler)(char**);
+};
+
+static const struct ownCmd ListOfOwnCmds[] = {
+    { "exit", exitCmd },
+    { "cd", cdCmd },
+    { "help", helpCmd },
+    { "hello", helloCmd },
+};
+
 // Function to execute builtin commands
 int ownCmdHandler(char** parsed)
 {
-    int NoOfOwnCmds = 4, i, switchOwnArg = 0;
-    char* ListOfOwnCmds[NoOfOwnCmds];
-    char* username;
-
-    ListOfOwnCmds[0] = "exit";
-    ListOfOwnCmds[1] = "cd";
-    ListOfOwnCmds[2] = "help";
-    ListOfOwnCmds[3] = "hello";
-
-    for (i = 0; i < NoOfOwnCmds; i++) {
-        if (strcmp(parsed[0], ListOfOwnCmds[i]) == 0) {
-            switchOwnArg = i + 1;
-            break;
-        }
-    }
+    size_t i;
 
-    switch (switchOwnArg) {
-    case 1:
-        printf("\nGoodbye\n");
-        exit(0);
-    case 2:
-        chdir(parsed[1]);
-        return 1;
-    case 3:
-        openHelp();
-        return 1;
-    case 4:
-        username = getenv("USER");
-        printf("\nHello %s.\nMind that this is "
-            "not a place to play around."
-            "\nUse help to know more..\n",
-            username);
-        return 1;
-    default:
-        break;
+    for (i = 0; i < sizeof(ListOfOwnCmds) / sizeof(ListOfOwnCmds[0]); i++) {
+        if (strcmp(parsed[0], ListOfOwnCmds[i].name) == 0)
+            return ListOfOwnCmds[i].handler(parsed);
     }
 
     return 0;
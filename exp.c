@@ -4,6 +4,7 @@ void execute_command(char *cmd) {
     char *pipe_pos = strchr(cmd, '|');
     int pipe_fd[2];
     int in_fd = 0;
+    int stage_count = 0; // Stages forked but not yet reaped
 
     while (pipe_pos) {
         *pipe_pos = '\0'; // Split the command at the pipe
@@ -13,10 +14,12 @@ void execute_command(char *cmd) {
             return;
         }
 
-        if (fork() == 0) {
+        pid_t pid = fork();
+        if (pid == 0) {
             dup2(in_fd, STDIN_FILENO); // Change input according to the old one
             dup2(pipe_fd[1], STDOUT_FILENO); // Change output according to the new one
             close(pipe_fd[0]);
+            close(pipe_fd[1]);
 
             // Parse and execute the command before the pipe
             args = NULL;
@@ -44,8 +47,13 @@ void execute_command(char *cmd) {
             exit(EXIT_FAILURE);
         }
 
+        if (pid > 0) {
+            stage_count++; // Don't wait: the next stage must start reading now
+        }
         close(pipe_fd[1]);
-        wait(NULL); // Wait for the child process
+        if (in_fd != 0) {
+            close(in_fd); // The stage just forked owns the previous read end now
+        }
         in_fd = pipe_fd[0];
         cmd = pipe_pos + 1; // Move to the next part of the command
         pipe_pos = strchr(cmd, '|');
@@ -184,10 +192,18 @@ void execute_command(char *cmd) {
             printf("Invalid Command\n");
             exit(EXIT_FAILURE);
         } else if (pid > 0) {
-            wait(NULL);
+            waitpid(pid, NULL, 0);
         } else {
             printf("Invalid Command\n");
         }
     }
+
+    // Reap the upstream stages together once the last one is done
+    if (in_fd != 0) {
+        close(in_fd);
+    }
+    while (stage_count > 0 && wait(NULL) > 0) {
+        stage_count--;
+    }
     free(args);
 }